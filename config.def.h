@@ -44,6 +44,121 @@
  */
 #define SCROLLBACK 1000
 
+/* Output from each virtual terminal is read into a buffer of RINGSIZE
+ * bytes (which must be a power of two) before it is processed. Programs
+ * writing to a virtual terminal only have to wait if this buffer fills up.
+ */
+#define RINGSIZE 65536
+
+/* Input for each virtual terminal (keys typed, text pasted, answers to
+ * its questions) is queued in a buffer of INPUT_BUFFER bytes (which must be
+ * a power of two) and written to it in one go. If a program is slow to
+ * read its input and the buffer fills up, text pasted into it waits for it
+ * to catch up, however much there is, and none of it is lost. Keys typed
+ * outside a paste are dropped instead, with a bell, so the keyboard is
+ * still read and mtm's own commands keep working whatever the program does.
+ */
+#define INPUT_BUFFER 65536
+
+/* When a virtual terminal has more than FAST_FORWARD screenfuls of output
+ * waiting to be processed (up to RINGSIZE bytes), mtm takes plain text in a
+ * line at a time instead of a character at a time, and scrolls the screen
+ * once for all of it. What ends up on the screen and in the scrollback is
+ * the same either way; this just keeps up with programs that print a lot.
+ * Zero turns this off.
+ */
+#define FAST_FORWARD 2
+
+/* Output from the focused virtual terminal is processed first, all of it.
+ * The others get BACKGROUND_BYTES of output and BACKGROUND_TIME microseconds
+ * of processing each per frame of FRAME_TIME milliseconds, so that a few busy
+ * terminals can't slow down typing in another; what doesn't fit waits for
+ * the next frame, and programs writing more wait until there's room. A
+ * terminal can be throttled to THROTTLE_BYTES per frame, even while it's
+ * focused, with the throttle key below.
+ */
+#define FRAME_TIME       16
+#define BACKGROUND_BYTES 65536
+#define BACKGROUND_TIME  4000
+#define THROTTLE_BYTES   1024
+
+/* Normally mtm reads output from virtual terminals in between drawing the
+ * screen and handling keyboard input. Set IO_THREAD to 1 to have a
+ * dedicated thread do the reading instead, so that programs running
+ * inside mtm never wait on a slow host terminal.
+ */
+#define IO_THREAD 0
+
+/* When several virtual terminals are busy at once, mtm can process their
+ * output in parallel. EMULATION_THREADS sets how many extra threads to
+ * use for this; zero means everything is processed on the main thread.
+ * The extra threads only ever draw in their own terminals' windows, and
+ * leave anything curses shares (color pairs, the bell) to the main thread,
+ * so the ordinary, non-thread-safe ncursesw will do.
+ */
+#define EMULATION_THREADS 0
+
+/* Normally curses puts the screen on the host terminal. Set DIRECT_RENDER
+ * to 1 (or run mtm with -r) to have mtm send the changes to each frame
+ * itself, in a single write, which usually takes fewer bytes and less
+ * time. Hosts without cursor addressing fall back to curses.
+ */
+#define DIRECT_RENDER 0
+
+/* When it draws the screen itself, mtm scrolls views on the host terminal
+ * as their contents scroll, so that only the new lines need to be sent.
+ * Views that don't span the whole screen need left and right margins for
+ * that. Many terminals claim to be xterm, whose terminfo entry offers
+ * margins, without having them; set HOST_MARGINS to 1 if yours really
+ * does, as xterm itself does.
+ */
+#define HOST_MARGINS 0
+
+/* Applications can ask mtm to hold off drawing their screen while they
+ * update it, so that half-finished screens are never shown. If the update
+ * isn't finished after SYNC_TIMEOUT milliseconds, mtm draws it anyway.
+ */
+#define SYNC_TIMEOUT 150
+
+/* When the host terminal is resized, or a terminal is split, mtm redraws
+ * right away but waits until nothing has changed for RESIZE_DELAY
+ * milliseconds before telling the programs inside their new sizes, so that
+ * dragging a window doesn't make them redraw at every size it passes.
+ */
+#define RESIZE_DELAY 100
+
+/* Sessions (see the '-s' flag) can be watched by observers. Each observer
+ * has a buffer of OBSERVE_BUFFER bytes (which must be a power of two and
+ * hold a whole screen); if an observer falls that far behind, it is sent a
+ * fresh picture of the screen once it catches up, instead of the output
+ * it missed.
+ */
+#define OBSERVE_BUFFER 262144
+
+/* Clients and observers say what they want as soon as they connect to a
+ * session; a connection that hasn't said anything after GREET_TIMEOUT
+ * milliseconds is dropped.
+ */
+#define GREET_TIMEOUT 2000
+
+/* A virtual terminal's output can be copied to a file or command as it
+ * arrives (see the log key below). Each log has a buffer of LOG_BUFFER
+ * bytes (which must be a power of two). If the file or command can't keep
+ * up and the buffer fills, output that doesn't fit is dropped and counted
+ * in the performance counters; set LOG_BACKPRESSURE to 1 to have the
+ * virtual terminal wait for its log instead, like it would for a slow
+ * terminal. Either way, the screen and keyboard carry on as usual.
+ */
+#define LOG_BUFFER 1048576
+#define LOG_BACKPRESSURE 0
+
+/* When mtm is asked to write its performance counters (see the '-S' flag),
+ * it also records the last TRACE_EVENTS events (reading output, drawing,
+ * keys and so on) and writes them out with the counters. This costs 16
+ * bytes per event, and must be a power of two; zero turns tracing off.
+ */
+#define TRACE_EVENTS 32768
+
 /* The default command prefix key, when modified by cntrl.
  * This can be changed at runtime using the '-c' flag.
  */
@@ -63,6 +178,10 @@
 /* The delete terminal key. */
 #define DELETE_NODE KEY(L'w')
 
+/* The balance key: share the screen out evenly among the terminals in the
+ * current window. */
+#define BALANCE KEY(L'=')
+
 /* does nothing, specifically */
 #define BAILOUT KEY(L'c')
 
@@ -72,20 +191,44 @@
 /* The force redraw key. */
 #define REDRAW KEY(L'l')
 
+/* The detach key, for sessions started with the '-s' flag. */
+#define DETACH KEY(L'd')
+
+/* The search keys: search the scrollback for text, or for a regular
+ * expression. */
+#define SEARCH       KEY(L'/')
+#define SEARCH_REGEX KEY(L'?')
+
+/* The export keys: write the scrollback to a file, or to a command if it
+ * starts with '|', as plain text or with its attributes. */
+#define EXPORT_TEXT KEY(L'e')
+#define EXPORT_SGR  KEY(L'E')
+
+/* The log key: copy everything a terminal prints from now on to a file, or
+ * to a command if it starts with '|'. Pressed again, it stops. */
+#define LOG_OUTPUT KEY(L'p')
+
+/* The window keys: open a new window, and go to the next or previous one. */
+#define NEW_WINDOW  KEY(L't')
+#define NEXT_WINDOW KEY(L'n')
+#define PREV_WINDOW KEY(L'N')
+
+/* The zoom key: make the focused terminal fill the screen, or put it back. */
+#define ZOOM KEY(L'z')
+
+/* The throttle key: hold the focused terminal to THROTTLE_BYTES of output a
+ * frame, or let it go again. */
+#define THROTTLE KEY(L'b')
+
 /* The scrollback keys. */
 #define SCROLLUP CODE(KEY_PPAGE)
 #define SCROLLDOWN CODE(KEY_NPAGE)
 #define RECENTER CODE(KEY_END)
 
-/* The path for the wide-character curses library. */
-#ifndef NCURSESW_INCLUDE_H
-    #if defined(__APPLE__) || !defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-        #define NCURSESW_INCLUDE_H <curses.h>
-    #else
-        #define NCURSESW_INCLUDE_H <ncursesw/curses.h>
-    #endif
-#endif
-#include NCURSESW_INCLUDE_H
+/* The path for the wide-character curses library is chosen in wcurses.h;
+ * define NCURSESW_INCLUDE_H (with -D, so every file sees it) to override.
+ */
+#include "wcurses.h"
 
 /* Includes needed to make forkpty(3) work. */
 #ifndef FORKPTY_INCLUDE_H
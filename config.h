@@ -0,0 +1,351 @@
+/* Old versions of ncurses don't support A_ITALIC.
+ * Define this to disable it if the situation isn't automatically detected.
+#define NO_ITALICS
+ */
+
+/* mtm advertises support for italic text by default. If the host
+ * terminal does not support italics, this will fail. Define this
+ * to map italic text to reverse text.
+#define REVERSE_ITALICS
+ */
+
+/* mtm by default will advertise itself as a "screen-bce" terminal.
+ * This is the terminal type advertised by such programs as
+ * screen(1) and tmux(1) and is a widely-supported terminal type.
+ * mtm supports emulating the "screen-bce" terminal very well, and this
+ * is a reasonable default.
+ *
+ * However, you can change the default terminal that mtm will
+ * advertise itself as. There's the "mtm" terminal type that is
+ * recommended for use if you know it will be available in all the
+ * environments in which mtm will be used. It advertises a few
+ * features that mtm has that the default "screen-bce" terminfo doesn't
+ * list, meaning that terminfo-aware programs may get a small
+ * speed boost.
+ */
+#define DEFAULT_TERMINAL "screen-bce"
+#define DEFAULT_256_COLOR_TERMINAL "screen-256color-bce"
+
+/* Sets how long (in milliseconds) mtm should wait for an escape sequence
+ * to follow after the escape key is pressed before sending it on to
+ * the focused virtual terminal.
+ */
+#define ESCAPE_TIME 500
+
+/* mtm supports a scrollback buffer, allowing users to scroll back
+ * through the output history of a virtual terminal. The SCROLLBACK
+ * knob controls how many lines are saved (minus however many are
+ * currently displayed). 1000 seems like a good number.
+ *
+ * Note that every virtual terminal is sized to be at least this big,
+ * so setting a huge number here might waste memory. It is recommended
+ * that this number be at least as large as the largest terminal you
+ * expect to use is tall.
+ */
+#define SCROLLBACK 1000
+
+/* Output from each virtual terminal is read into a buffer of RINGSIZE
+ * bytes (which must be a power of two) before it is processed. Programs
+ * writing to a virtual terminal only have to wait if this buffer fills up.
+ */
+#define RINGSIZE 65536
+
+/* Input for each virtual terminal (keys typed, text pasted, answers to
+ * its questions) is queued in a buffer of INPUT_BUFFER bytes (which must be
+ * a power of two) and written to it in one go. If a program is slow to
+ * read its input and the buffer fills up, text pasted into it waits for it
+ * to catch up, however much there is, and none of it is lost. Keys typed
+ * outside a paste are dropped instead, with a bell, so the keyboard is
+ * still read and mtm's own commands keep working whatever the program does.
+ */
+#define INPUT_BUFFER 65536
+
+/* When a virtual terminal has more than FAST_FORWARD screenfuls of output
+ * waiting to be processed (up to RINGSIZE bytes), mtm takes plain text in a
+ * line at a time instead of a character at a time, and scrolls the screen
+ * once for all of it. What ends up on the screen and in the scrollback is
+ * the same either way; this just keeps up with programs that print a lot.
+ * Zero turns this off.
+ */
+#define FAST_FORWARD 2
+
+/* Output from the focused virtual terminal is processed first, all of it.
+ * The others get BACKGROUND_BYTES of output and BACKGROUND_TIME microseconds
+ * of processing each per frame of FRAME_TIME milliseconds, so that a few busy
+ * terminals can't slow down typing in another; what doesn't fit waits for
+ * the next frame, and programs writing more wait until there's room. A
+ * terminal can be throttled to THROTTLE_BYTES per frame, even while it's
+ * focused, with the throttle key below.
+ */
+#define FRAME_TIME       16
+#define BACKGROUND_BYTES 65536
+#define BACKGROUND_TIME  4000
+#define THROTTLE_BYTES   1024
+
+/* Normally mtm reads output from virtual terminals in between drawing the
+ * screen and handling keyboard input. Set IO_THREAD to 1 to have a
+ * dedicated thread do the reading instead, so that programs running
+ * inside mtm never wait on a slow host terminal.
+ */
+#define IO_THREAD 0
+
+/* When several virtual terminals are busy at once, mtm can process their
+ * output in parallel. EMULATION_THREADS sets how many extra threads to
+ * use for this; zero means everything is processed on the main thread.
+ * The extra threads only ever draw in their own terminals' windows, and
+ * leave anything curses shares (color pairs, the bell) to the main thread,
+ * so the ordinary, non-thread-safe ncursesw will do.
+ */
+#define EMULATION_THREADS 0
+
+/* Normally curses puts the screen on the host terminal. Set DIRECT_RENDER
+ * to 1 (or run mtm with -r) to have mtm send the changes to each frame
+ * itself, in a single write, which usually takes fewer bytes and less
+ * time. Hosts without cursor addressing fall back to curses.
+ */
+#define DIRECT_RENDER 0
+
+/* When it draws the screen itself, mtm scrolls views on the host terminal
+ * as their contents scroll, so that only the new lines need to be sent.
+ * Views that don't span the whole screen need left and right margins for
+ * that. Many terminals claim to be xterm, whose terminfo entry offers
+ * margins, without having them; set HOST_MARGINS to 1 if yours really
+ * does, as xterm itself does.
+ */
+#define HOST_MARGINS 0
+
+/* Applications can ask mtm to hold off drawing their screen while they
+ * update it, so that half-finished screens are never shown. If the update
+ * isn't finished after SYNC_TIMEOUT milliseconds, mtm draws it anyway.
+ */
+#define SYNC_TIMEOUT 150
+
+/* When the host terminal is resized, or a terminal is split, mtm redraws
+ * right away but waits until nothing has changed for RESIZE_DELAY
+ * milliseconds before telling the programs inside their new sizes, so that
+ * dragging a window doesn't make them redraw at every size it passes.
+ */
+#define RESIZE_DELAY 100
+
+/* Sessions (see the '-s' flag) can be watched by observers. Each observer
+ * has a buffer of OBSERVE_BUFFER bytes (which must be a power of two and
+ * hold a whole screen); if an observer falls that far behind, it is sent a
+ * fresh picture of the screen once it catches up, instead of the output
+ * it missed.
+ */
+#define OBSERVE_BUFFER 262144
+
+/* Clients and observers say what they want as soon as they connect to a
+ * session; a connection that hasn't said anything after GREET_TIMEOUT
+ * milliseconds is dropped.
+ */
+#define GREET_TIMEOUT 2000
+
+/* A virtual terminal's output can be copied to a file or command as it
+ * arrives (see the log key below). Each log has a buffer of LOG_BUFFER
+ * bytes (which must be a power of two). If the file or command can't keep
+ * up and the buffer fills, output that doesn't fit is dropped and counted
+ * in the performance counters; set LOG_BACKPRESSURE to 1 to have the
+ * virtual terminal wait for its log instead, like it would for a slow
+ * terminal. Either way, the screen and keyboard carry on as usual.
+ */
+#define LOG_BUFFER 1048576
+#define LOG_BACKPRESSURE 0
+
+/* When mtm is asked to write its performance counters (see the '-S' flag),
+ * it also records the last TRACE_EVENTS events (reading output, drawing,
+ * keys and so on) and writes them out with the counters. This costs 16
+ * bytes per event, and must be a power of two; zero turns tracing off.
+ */
+#define TRACE_EVENTS 32768
+
+/* The default command prefix key, when modified by cntrl.
+ * This can be changed at runtime using the '-c' flag.
+ */
+#define COMMAND_KEY 'g'
+
+/* The change focus keys. */
+#define MOVE_UP         CODE(KEY_UP)
+#define MOVE_DOWN       CODE(KEY_DOWN)
+#define MOVE_RIGHT      CODE(KEY_RIGHT)
+#define MOVE_LEFT       CODE(KEY_LEFT)
+#define MOVE_OTHER      KEY(L'o')
+
+/* The split terminal keys. */
+#define HSPLIT KEY(L'h')
+#define VSPLIT KEY(L'v')
+
+/* The delete terminal key. */
+#define DELETE_NODE KEY(L'w')
+
+/* The balance key: share the screen out evenly among the terminals in the
+ * current window. */
+#define BALANCE KEY(L'=')
+
+/* does nothing, specifically */
+#define BAILOUT KEY(L'c')
+
+/* clears the scrollback and everything */
+#define NUKE KEY(L'k')
+
+/* The force redraw key. */
+#define REDRAW KEY(L'l')
+
+/* The detach key, for sessions started with the '-s' flag. */
+#define DETACH KEY(L'd')
+
+/* The search keys: search the scrollback for text, or for a regular
+ * expression. */
+#define SEARCH       KEY(L'/')
+#define SEARCH_REGEX KEY(L'?')
+
+/* The export keys: write the scrollback to a file, or to a command if it
+ * starts with '|', as plain text or with its attributes. */
+#define EXPORT_TEXT KEY(L'e')
+#define EXPORT_SGR  KEY(L'E')
+
+/* The log key: copy everything a terminal prints from now on to a file, or
+ * to a command if it starts with '|'. Pressed again, it stops. */
+#define LOG_OUTPUT KEY(L'p')
+
+/* The window keys: open a new window, and go to the next or previous one. */
+#define NEW_WINDOW  KEY(L't')
+#define NEXT_WINDOW KEY(L'n')
+#define PREV_WINDOW KEY(L'N')
+
+/* The zoom key: make the focused terminal fill the screen, or put it back. */
+#define ZOOM KEY(L'z')
+
+/* The throttle key: hold the focused terminal to THROTTLE_BYTES of output a
+ * frame, or let it go again. */
+#define THROTTLE KEY(L'b')
+
+/* The scrollback keys. */
+#define SCROLLUP CODE(KEY_PPAGE)
+#define SCROLLDOWN CODE(KEY_NPAGE)
+#define RECENTER CODE(KEY_END)
+
+/* The path for the wide-character curses library is chosen in wcurses.h;
+ * define NCURSESW_INCLUDE_H (with -D, so every file sees it) to override.
+ */
+#include "wcurses.h"
+
+/* Includes needed to make forkpty(3) work. */
+#ifndef FORKPTY_INCLUDE_H
+    #if defined(__APPLE__) || defined(__OpenBSD__)
+        #define FORKPTY_INCLUDE_H <util.h>
+    #elif defined(__FreeBSD__)
+        #define FORKPTY_INCLUDE_H <libutil.h>
+    #else
+        #define FORKPTY_INCLUDE_H <pty.h>
+    #endif
+#endif
+#include FORKPTY_INCLUDE_H
+
+/* You probably don't need to alter these much, but if you do,
+ * here is where you can define alternate character sets.
+ *
+ * Note that if your system's wide-character implementation
+ * maps directly to Unicode, the preferred Unicode characters
+ * will be used automatically if your system declares such
+ * support. If it doesn't declare it, define WCHAR_IS_UNICODE to
+ * force Unicode to be used.
+ */
+#define MAXMAP 0x7f
+static wchar_t CSET_US[MAXMAP]; /* "USASCII"...really just the null table */
+
+#if defined(__STDC_ISO_10646__) || defined(WCHAR_IS_UNICODE)
+static wchar_t CSET_UK[MAXMAP] ={ /* "United Kingdom"...really just Pound Sterling */
+    [L'#'] = 0x00a3
+};
+
+static wchar_t CSET_GRAPH[MAXMAP] ={ /* Graphics Set One */
+    [L'-'] = 0x2191,
+    [L'}'] = 0x00a3,
+    [L'~'] = 0x00b7,
+    [L'{'] = 0x03c0,
+    [L','] = 0x2190,
+    [L'+'] = 0x2192,
+    [L'.'] = 0x2193,
+    [L'|'] = 0x2260,
+    [L'>'] = 0x2265,
+    [L'`'] = 0x25c6,
+    [L'a'] = 0x2592,
+    [L'b'] = 0x2409,
+    [L'c'] = 0x240c,
+    [L'd'] = 0x240d,
+    [L'e'] = 0x240a,
+    [L'f'] = 0x00b0,
+    [L'g'] = 0x00b1,
+    [L'h'] = 0x2592,
+    [L'i'] = 0x2603,
+    [L'j'] = 0x2518,
+    [L'k'] = 0x2510,
+    [L'l'] = 0x250c,
+    [L'm'] = 0x2514,
+    [L'n'] = 0x253c,
+    [L'o'] = 0x23ba,
+    [L'p'] = 0x23bb,
+    [L'q'] = 0x2500,
+    [L'r'] = 0x23bc,
+    [L's'] = 0x23bd,
+    [L't'] = 0x251c,
+    [L'u'] = 0x2524,
+    [L'v'] = 0x2534,
+    [L'w'] = 0x252c,
+    [L'x'] = 0x2502,
+    [L'y'] = 0x2264,
+    [L'z'] = 0x2265,
+    [L'_'] = L' ',
+    [L'0'] = 0x25ae
+};
+
+#else /* wchar_t doesn't map to Unicode... */
+
+static wchar_t CSET_UK[] ={ /* "United Kingdom"...really just Pound Sterling */
+    [L'#'] = L'&'
+};
+
+static wchar_t CSET_GRAPH[] ={ /* Graphics Set One */
+    [L'-'] = '^',
+    [L'}'] = L'&',
+    [L'~'] = L'o',
+    [L'{'] = L'p',
+    [L','] = L'<',
+    [L'+'] = L'>',
+    [L'.'] = L'v',
+    [L'|'] = L'!',
+    [L'>'] = L'>',
+    [L'`'] = L'+',
+    [L'a'] = L':',
+    [L'b'] = L' ',
+    [L'c'] = L' ',
+    [L'd'] = L' ',
+    [L'e'] = L' ',
+    [L'f'] = L'\'',
+    [L'g'] = L'#',
+    [L'h'] = L'#',
+    [L'i'] = L'i',
+    [L'j'] = L'+',
+    [L'k'] = L'+',
+    [L'l'] = L'+',
+    [L'm'] = L'+',
+    [L'n'] = '+',
+    [L'o'] = L'-',
+    [L'p'] = L'-',
+    [L'q'] = L'-',
+    [L'r'] = L'-',
+    [L's'] = L'_',
+    [L't'] = L'+',
+    [L'u'] = L'+',
+    [L'v'] = L'+',
+    [L'w'] = L'+',
+    [L'x'] = L'|',
+    [L'y'] = L'<',
+    [L'z'] = L'>',
+    [L'_'] = L' ',
+    [L'0'] = L'#',
+};
+
+#endif
+
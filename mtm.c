@@ -17,19 +17,28 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <locale.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <regex.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
 
+#include "render.h"
+#include "ring.h"
+#include "session.h"
+#include "trace.h"
 #include "vtparser.h"
+#include "width.h"
 
 /*** CONFIGURATION */
 #include "config.h"
@@ -37,7 +46,18 @@
 #define MIN(x, y) ((x) < (y)? (x) : (y))
 #define MAX(x, y) ((x) > (y)? (x) : (y))
 #define CTL(x) ((x) & 0x1f)
-#define USAGE "usage: mtm [-T NAME] [-t NAME] [-c KEY]\n"
+#define MAXQUERY 255
+#define EXPORTCHUNK 256 /* lines exported at a time */
+#define KEYROOM 64 /* more than any one key sends */
+#define SLICE 512 /* background output is processed this much at a time */
+#define KEY_PASTE_START (KEY_MAX + 1)
+#define KEY_PASTE_END (KEY_MAX + 2)
+#define MAXWORD 256 /* longest word in a key map */
+#define MAXREP 256 /* characters repeated at a time */
+#define NKEYS (KEY_MAX + 3) /* characters below KEY_MIN, and key codes */
+#define USAGE "usage: mtm [-T NAME] [-t NAME] [-c KEY] [-k PATH] [-s PATH]\n" \
+              "           [-S PATH] [-r]\n" \
+              "       mtm -s PATH -o|-O PANE\n"
 
 /*** DATA TYPES */
 typedef enum{
@@ -46,54 +66,330 @@ typedef enum{
     VIEW
 } Node;
 
+typedef enum{ /* which key map a key is looked up in */
+    BIND_KEY,      /* typed as usual */
+    BIND_COMMAND,  /* typed after the command key */
+    BIND_SCROLLED, /* typed as usual while scrolled back; tried first */
+    NBINDS
+} Keymap;
+
+typedef enum{ /* what a key can do */
+    DO_NOTHING, /* not bound: the key is sent as typed */
+    DO_SEND,
+    DO_RETURN,
+    DO_ARROW,
+    DO_COMMAND,
+    DO_RESIZE,
+    DO_MOVE_UP,
+    DO_MOVE_DOWN,
+    DO_MOVE_LEFT,
+    DO_MOVE_RIGHT,
+    DO_MOVE_OTHER,
+    DO_HSPLIT,
+    DO_VSPLIT,
+    DO_DELETE,
+    DO_BAILOUT,
+    DO_NUKE,
+    DO_REDRAW,
+    DO_DETACH,
+    DO_SEARCH,
+    DO_SEARCH_REGEX,
+    DO_EXPORT_TEXT,
+    DO_EXPORT_SGR,
+    DO_LOG,
+    DO_SCROLLUP,
+    DO_SCROLLDOWN,
+    DO_RECENTER,
+    DO_NEW_WINDOW,
+    DO_NEXT_WINDOW,
+    DO_PREV_WINDOW,
+    DO_ZOOM,
+    DO_THROTTLE,
+    DO_BALANCE,
+    NACTIONS
+} Action;
+
+typedef enum{ /* what a name being typed is for */
+    NAME_TEXT,
+    NAME_SGR,
+    NAME_LOG
+} Naming;
+
 typedef struct SCRN SCRN;
 struct SCRN{
     int sy, sx, vis, tos, off;
-    short fg, bg, sfg, sbg, sp;
+    int fg, bg, sfg, sbg, pfg, pbg;
+    int st, sb, up; /* rows st to sb of the pad scrolled up lines since drawn */
+    short sp, cp;
     bool insert, oxenl, xenl, saved;
+    bool tangled; /* scrolled in more than one region since drawn */
     attr_t sattr;
     WINDOW *win;
 };
 
+/* Latencies are counted in buckets: a microsecond apart up to 16us, then
+ * eight to each doubling, up to about a minute.
+ */
+#define NLATENCY 192
+
+typedef struct LATENCY LATENCY;
+struct LATENCY{
+    unsigned long long n, max; /* max is in ns */
+    unsigned b[NLATENCY];
+};
+
+typedef struct STATS STATS;
+struct STATS{
+    unsigned long long reads, bytes, parse, scrolls, renders, frames, frame;
+    unsigned long long logged, dropped; /* bytes copied to a log, or not */
+    unsigned long long skimmed; /* bytes taken in by fast-forwarding */
+    unsigned long long host; /* bytes sent to the host, when we send them */
+    unsigned long long keys; /* keys sent to the view */
+    unsigned long long counts[VTPARSER_PRINT + 1]; /* times are in ns */
+    LATENCY echo, shown; /* from a key to its output, and to the screen */
+};
+
 typedef struct NODE NODE;
+typedef struct EXPORT EXPORT;
+struct EXPORT{
+    int fd;
+    bool sgr;
+    NODE *n; /* NULL once the view is gone */
+    SCRN *s;
+    long long line, last, blanks; /* next line, last one, blanks held back */
+    char *b; /* output not yet written */
+    size_t l, done;
+    EXPORT *next;
+};
+
+typedef struct LOG LOG;
+struct LOG{
+    int fd;
+    NODE *n; /* NULL once the view is gone or has stopped logging */
+    RING *q;
+    LOG *next;
+};
+
+typedef struct BINDING BINDING;
+struct BINDING{
+    Action a;
+    char *s; /* what to send, or which arrow */
+    size_t l;
+};
+
+typedef struct TEXT TEXT;
+struct TEXT{
+    long long line;
+    char *s;
+};
+
 struct NODE{
     Node t;
-    int y, x, h, w, pt, ntabs;
-    bool *tabs, pnm, decom, am, lnm;
+    int id, y, x, h, w, pt, ntabs;
+    bool *tabs, pnm, decom, am, lnm, dirty, paste;
+    bool winch; /* its size changed and the program hasn't been told */
+    bool throttled; /* held to THROTTLE_BYTES a frame, even when focused */
+    bool bell; /* rang while being processed, maybe on a worker */
+    size_t took; /* bytes of output processed this frame */
+    long long cpu; /* and how long that took, in ns */
+    long long syncat; /* when synchronized output started, if it has */
+    long long keyat, echoat; /* when the oldest unanswered key was sent,
+                                and when output after it was processed */
+    long long pushed; /* how many lines have gone into the scrollback */
+    TEXT *ix; /* text of scrollback lines, by line number, for searching */
+    long long kept; /* the first line that isn't in ix yet */
+    cchar_t *row; /* room to move a row of cells around in */
+    int nrow;
+    LOG *log; /* where output is copied as it arrives, if anywhere */
     wchar_t repc;
-    NODE *p, *c1, *c2;
+    NODE *p, **c; /* parent, and children left to right or top to bottom */
+    int nc, wt; /* how many children; share of the parent's room */
     SCRN pri, alt, *s;
     wchar_t *g0, *g1, *g2, *g3, *gc, *gs, *sgc, *sgs;
     VTPARSER vp;
+    RING *rb, *wq; /* output read from the pty, input to write to it */
+    SCRN *drawn; /* the screen last drawn, if it's still where it was, */
+    int drawnoff; /* and its offset then */
+    STATS st;
+};
+
+typedef struct DESK DESK;
+struct DESK{ /* a window: a tree of views, shown one at a time */
+    NODE *root, *focused, *lastfocused, *zoomed;
+    DESK *next;
+};
+
+typedef struct OBSERVER OBSERVER;
+struct OBSERVER{
+    int fd;
+    bool screen, stale, lost, dead; /* wants pictures, not output; picture
+                                       is out of date; output was dropped;
+                                       hung up or about to be */
+    NODE *n;
+    RING *q;
+    OBSERVER *next;
+};
+
+typedef struct GUEST GUEST;
+struct GUEST{ /* a connection to the session socket that hasn't spoken yet */
+    int fd;
+    long long at; /* when it connected */
+    GUEST *next;
 };
 
 /*** GLOBALS AND PROTOTYPES */
 static NODE *root, *focused, *lastfocused = NULL;
+
+/* The current window lives in root and friends; the others are put away
+ * in their DESKs. Only the current window, or its zoomed view, is drawn,
+ * but every view is read from and kept up to date.
+ */
+static DESK *desks, *desk;
+static NODE *zoomed;
+#define ROOT(d) ((d) == desk? root : (d)->root)
 static int commandkey = CTL(COMMAND_KEY), nfds = 1; /* stdin */
 static fd_set fds;
-static char iobuf[BUFSIZ];
+static long long syncdue; /* when the next synchronized update times out */
+static long long winchdue; /* when to tell programs their new sizes */
+static long long frameat; /* when views were last given their budgets */
+static bool direct = DIRECT_RENDER; /* draw the screen ourselves */
+
+/* Counters are kept all the time, and written out on request along with
+ * the trace of recent events, if it's on.
+ */
+static const char *statspath;
+static STATS totals; /* for the whole screen, and views that are gone */
+static long long started;
+static volatile sig_atomic_t wantstats;
+static int askfd[2] = {-1, -1}; /* wakes us up when the stats are wanted */
+
+/* Searching happens in the focused view. Lines are numbered from the first
+ * one ever pushed into its scrollback, so that a match stays put while
+ * more output scrolls by.
+ */
+static NODE *searching;
+static wchar_t query[MAXQUERY + 1];
+static int nquery, oldoff;
+static bool regexsearch, compiled, found, stuck;
+static regex_t re;
+static long long hitline; /* the current match */
+static int hitat, hitlen;
+
+/* Views are exported a chunk at a time, in between everything else. */
+static EXPORT *exports;
+static NODE *naming; /* whose export or log is waiting for somewhere to go */
+static Naming namingfor;
+
+/* Keys are looked up by code; those not bound are sent as typed. */
+static bool pasting; /* between the brackets of a paste */
+static BINDING keymap[NBINDS][NKEYS];
+static const char *keymaps[NBINDS] ={"key", "command", "scrolled"};
+static const char *actions[NACTIONS] ={
+    "unbind", "send", "return", "arrow", "command", "resize", "move-up",
+    "move-down", "move-left", "move-right", "move-other", "hsplit", "vsplit",
+    "delete", "bailout", "nuke", "redraw", "detach", "search", "search-regex",
+    "export", "export-sgr", "log", "scroll-up", "scroll-down", "recenter",
+    "new-window", "next-window", "prev-window", "zoom",
+    "throttle", "balance"
+};
+
+/* Logs are queued by whoever processes the view, and written out by us. */
+static LOG *logs;
+
+/* With IO_THREAD, views are looked up by pty on the input thread. */
+static NODE *views[FD_SETSIZE];
+static int maxview = -1, wakefd[2] = {-1, -1}, pokefd[2] = {-1, -1};
+static pthread_mutex_t viewlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* With EMULATION_THREADS, busy views are handed out to a pool of workers. */
+static NODE **busy;
+static int nbusy, maxbusy, nextbusy, ndone;
+static unsigned long batch;
+static pthread_mutex_t worklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t donecond = PTHREAD_COND_INITIALIZER;
+
+/* With -s, we're a session server and our terminal comes and goes. */
+static const char *sockpath;
+static int lfd = -1, cfd = -1, lastid = 0;
+static bool detached = false;
+static OBSERVER *observers;
+static GUEST *guests;
 
 static void setupevents(NODE *n);
 static void reshape(NODE *n, int y, int x, int h, int w);
 static void draw(NODE *n);
+static void redraw(NODE *n);
 static void reshapechildren(NODE *n);
 static const char *term = NULL;
 static void freenode(NODE *n, bool recursive);
+static void unwatch(NODE *n);
+static void observe(NODE *n, const char *s, size_t l);
+static void dropobservers(NODE *n);
+static void forget(NODE *n);
+static void scrolled(NODE *n, int k);
+static void remember(NODE *n);
+static void drawsearch(NODE *n);
+static void drawprompt(NODE *n, const char *p, const char *m);
+static void dropexports(NODE *n);
+static void stoplog(NODE *n);
+static void resized(void);
 void start_pairs(void);
 short mtm_alloc_pair(int fg, int bg);
+void mtm_define_pairs(void);
+int mtm_color(int c);
+int mtm_pairs_used(void);
 
 /*** UTILITY FUNCTIONS */
+static void
+hostpaste(bool on) /* Have the host terminal bracket pastes, or not. */
+{
+    if (stdscr){
+        putp(on? "\033[?2004h" : "\033[?2004l");
+        fflush(stdout);
+    }
+}
+
+static void writestats(void);
+static void addstats(STATS *t, const NODE *n);
+static void addlatency(LATENCY *h, long long ns);
+
 static void
 quit(int rc, const char *m) /* Shut down MTM. */
 {
     if (m)
         fprintf(stderr, "%s\n", m);
-    if (root)
-        freenode(root, true);
+    if (statspath)
+        writestats();
+    for (DESK *d = desks; d; d = d->next)
+        freenode(ROOT(d), true);
+    hostpaste(false);
     endwin();
+    if (lfd >= 0)
+        unlink(sockpath);
     exit(rc);
 }
 
+static long long
+nsnow(void) /* Monotonic time in nanoseconds. */
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long
+now(void) /* Monotonic time in milliseconds. */
+{
+    return nsnow() / 1000000;
+}
+
+static long long
+soonest(long long a, long long b) /* The earlier of two times, zero being never. */
+{
+    return a && b? MIN(a, b) : a? a : b;
+}
+
 static void
 safewrite(int fd, const char *b, size_t n) /* Write, checking for errors. */
 {
@@ -108,6 +404,16 @@ safewrite(int fd, const char *b, size_t n) /* Write, checking for errors. */
     }
 }
 
+static void
+sendn(NODE *n, const char *s, size_t l) /* Queue s to be written to n. */
+{
+    /* Input is written out once per turn of the run loop. Keys are only
+     * queued while there's KEYROOM left, so answers to the program's
+     * questions are only lost if it isn't reading its input at all.
+     */
+    ringput(n->wq, s, l);
+}
+
 static const char *
 getshell(void) /* Get the user's preferred shell. */
 {
@@ -119,6 +425,72 @@ getshell(void) /* Get the user's preferred shell. */
     return "/bin/sh";
 }
 
+static short
+getpair(SCRN *s) /* Get the color pair for s's colors, remembering it. */
+{
+    if (s->pfg != s->fg || s->pbg != s->bg){
+        s->cp = mtm_alloc_pair(s->fg, s->bg);
+        s->pfg = s->fg;
+        s->pbg = s->bg;
+    }
+    return s->cp;
+}
+
+static cchar_t *
+rowbuf(NODE *n, int w) /* Get room for w cells and a terminator. */
+{
+    if (w + 1 > n->nrow){
+        cchar_t *r = realloc(n->row, sizeof(cchar_t) * (w + 1));
+        if (!r)
+            return NULL;
+        n->row = r;
+        n->nrow = w + 1;
+    }
+    return n->row;
+}
+
+static void
+putcells(NODE *n, int y, int x, int k, bool raw) /* Write k cells of row. */
+{
+    /* Cells written are mixed with the window's attributes and background,
+     * which is right for new ones but not for ones that are being moved. */
+    WINDOW *win = n->s->win;
+    cchar_t b, none;
+    attr_t a = A_NORMAL;
+    short cp = 0;
+    memset(n->row + k, 0, sizeof(cchar_t));
+    if (!raw){
+        mvwadd_wchnstr(win, y, x, n->row, k);
+        return;
+    }
+    wattr_get(win, &a, &cp, NULL);
+    wgetbkgrnd(win, &b);
+    setcchar(&none, L" ", A_NORMAL, 0, NULL);
+    wattr_set(win, A_NORMAL, 0, NULL);
+    wbkgrndset(win, &none);
+    mvwadd_wchnstr(win, y, x, n->row, k);
+    wbkgrndset(win, &b);
+    wattr_set(win, a, cp, NULL);
+}
+
+static void
+setcells(NODE *n, int y, int x, int k, cchar_t c, bool raw) /* k of c */
+{
+    if (k > 0 && rowbuf(n, k)){
+        for (int i = 0; i < k; i++)
+            n->row[i] = c;
+        putcells(n, y, x, k, raw);
+    }
+}
+
+static void
+movecells(NODE *n, int y, int from, int to, int k) /* Move k cells along y. */
+{
+    if (k > 0 && rowbuf(n, k)
+     && mvwin_wchnstr(n->s->win, y, from, n->row, k) != ERR)
+        putcells(n, y, to, k, true);
+}
+
 /*** TERMINAL EMULATION HANDLERS
  * These functions implement the various terminal commands activated by
  * escape sequences and printing to the terminal. Large amounts of boilerplate
@@ -142,11 +514,11 @@ getshell(void) /* Get the user's preferred shell. */
  *                       s        - the current SCRN buffer
  * The funny names for handlers are from their ANSI/ECMA/DEC mnemonics.
  */
-#define PD(x, d) (argc < (x) || !argv? (d) : argv[(x)])
+#define PD(x, d) (argc <= (x) || !argv? (d) : argv[(x)])
 #define P0(x) PD(x, 0)
 #define P1(x) (!P0(x)? 1 : P0(x))
 #define CALL(x) (x)(v, n, 0, 0, 0, NULL, NULL)
-#define SENDN(n, s, c) safewrite(n->pt, s, c)
+#define SENDN(n, s, c) sendn(n, s, c)
 #define SEND(n, s) SENDN(n, s, strlen(s))
 #define COMMONVARS                                                      \
     NODE *n = (NODE *)p;                                                \
@@ -170,7 +542,7 @@ getshell(void) /* Get the user's preferred shell. */
 #define ENDHANDLER n->repc = 0; } /* control sequences aren't repeated */
 
 HANDLER(bell) /* Terminal bell. */
-    beep();
+    n->bell = true; /* rung once the workers are done */
 ENDHANDLER
 
 HANDLER(numkp) /* Application/Numeric Keypad Mode */
@@ -187,13 +559,21 @@ HANDLER(cup) /* CUP - Cursor Position */
 ENDHANDLER
 
 HANDLER(dch) /* DCH - Delete Character */
-    for (int i = 0; i < P1(0); i++)
-        wdelch(win);
+    int k = MIN(P1(0), mx - x);
+    cchar_t b;
+    wgetbkgrnd(win, &b);
+    movecells(n, py, x + k, x, mx - x - k);
+    setcells(n, py, mx - k, k, b, true);
+    wmove(win, py, px);
 ENDHANDLER
 
 HANDLER(ich) /* ICH - Insert Character */
-    for (int i = 0; i < P1(0); i++)
-        wins_nwstr(win, L" ", 1);
+    int k = MIN(P1(0), mx - x);
+    cchar_t b;
+    setcchar(&b, L" ", A_NORMAL, 0, NULL);
+    movecells(n, py, x, x + k, mx - x - k);
+    setcells(n, py, x, k, b, false);
+    wmove(win, py, px);
 ENDHANDLER
 
 HANDLER(cuu) /* CUU - Cursor Up */
@@ -221,7 +601,10 @@ HANDLER(ri) /* RI - Reverse Index */
     int otop = 0, obot = 0;
     wgetscrreg(win, &otop, &obot);
     wsetscrreg(win, otop >= tos? otop : tos, obot);
+    if (y == top)
+        scrolled(n, -1);
     y == top? wscrl(win, -1) : wmove(win, MAX(tos, py - 1), x);
+    n->st.scrolls += y == top;
     wsetscrreg(win, otop, obot);
 ENDHANDLER
 
@@ -282,7 +665,9 @@ HANDLER(decaln) /* DECALN - Screen Alignment Test */
 ENDHANDLER
 
 HANDLER(su) /* SU - Scroll Up/Down */
+    scrolled(n, (w == L'T' || w == L'^')? -P1(0) : P1(0));
     wscrl(win, (w == L'T' || w == L'^')? -P1(0) : P1(0));
+    n->st.scrolls++;
 ENDHANDLER
 
 HANDLER(sc) /* SC - Save Cursor */
@@ -311,7 +696,7 @@ HANDLER(rc) /* RC - Restore Cursor */
     n->gc = n->sgc; n->gs = n->sgs;          /* save character sets        */
 
     /* restore colors */
-    int cp = mtm_alloc_pair(s->fg, s->bg);
+    int cp = getpair(s);
     wcolor_set(win, cp, NULL);
     cchar_t c;
     setcchar(&c, L" ", A_NORMAL, cp, NULL);
@@ -332,10 +717,10 @@ ENDHANDLER
 
 HANDLER(el) /* EL - Erase in Line */
     cchar_t b;
-    setcchar(&b, L" ", A_NORMAL, mtm_alloc_pair(s->fg, s->bg), NULL);
+    setcchar(&b, L" ", A_NORMAL, getpair(s), NULL);
     switch (P0(0)){
         case 0: wclrtoeol(win);                                                 break;
-        case 1: for (int i = 0; i <= x; i++) mvwadd_wchnstr(win, py, i, &b, 1); break;
+        case 1: setcells(n, py, 0, MIN(x + 1, mx), b, false);                   break;
         case 2: wmove(win, py, 0); wclrtoeol(win);                              break;
     }
     wmove(win, py, x);
@@ -345,7 +730,7 @@ HANDLER(ed) /* ED - Erase in Display */
     int o = 1;
     switch (P0(0)){
         case 0: wclrtobot(win);                     break;
-        case 3: werase(win);                        break;
+        case 3: werase(win); forget(n);             break;
         case 2: wmove(win, tos, 0); wclrtobot(win); break;
         case 1:
             for (int i = tos; i < py; i++){
@@ -361,9 +746,8 @@ ENDHANDLER
 
 HANDLER(ech) /* ECH - Erase Character */
     cchar_t c;
-    setcchar(&c, L" ", A_NORMAL, mtm_alloc_pair(s->fg, s->bg), NULL);
-    for (int i = 0; i < P1(0); i++)
-        mvwadd_wchnstr(win, py, x + i, &c, 1);
+    setcchar(&c, L" ", A_NORMAL, getpair(s), NULL);
+    setcells(n, py, x, MIN(P1(0), mx - x), c, false);
     wmove(win, py, px);
 ENDHANDLER
 
@@ -377,15 +761,42 @@ HANDLER(dsr) /* DSR - Device Status Report */
     SEND(n, buf);
 ENDHANDLER
 
+HANDLER(decrqm) /* DECRQM - Request Mode */
+    /* The answer is 1 if the mode is set, 2 if it's reset, and 0 if we
+     * don't have it. Other sequences end in p too; this one has a $. */
+    char buf[100] = {0};
+    int r = 0;
+    if (v->last != L'$')
+        return;
+    if (iw == L'?') switch (P0(0)){
+        case    1: r = n->pnm? 1 : 2;               break;
+        case    6: r = n->decom? 1 : 2;             break;
+        case    7: r = n->am? 1 : 2;                break;
+        case   25: r = s->vis? 1 : 2;               break;
+        case   47: case 1047: case 1049:
+                   r = n->s == &n->alt? 1 : 2;      break;
+        case 2004: r = n->paste? 1 : 2;             break;
+        case 2026: r = n->syncat? 1 : 2;            break;
+    } else switch (P0(0)){
+        case    4: r = s->insert? 1 : 2;            break;
+        case   20: r = n->lnm? 1 : 2;               break;
+    }
+    snprintf(buf, sizeof(buf) - 1, "\033[%s%d;%d$y", iw == L'?'? "?" : "",
+             P0(0), r);
+    SEND(n, buf);
+ENDHANDLER
+
 HANDLER(idl) /* IL or DL - Insert/Delete Line */
     /* we don't use insdelln here because it inserts above and not below,
      * and has a few other edge cases... */
     int otop = 0, obot = 0, p1 = MIN(P1(0), (my - 1) - y);
     wgetscrreg(win, &otop, &obot);
     wsetscrreg(win, py, obot);
+    scrolled(n, w == L'L'? -p1 : p1);
     wscrl(win, w == L'L'? -p1 : p1);
     wsetscrreg(win, otop, obot);
     wmove(win, py, 0);
+    n->st.scrolls++;
 ENDHANDLER
 
 HANDLER(csr) /* CSR - Change Scrolling Region */
@@ -417,9 +828,11 @@ HANDLER(ris) /* RIS - Reset to Initial State */
     CALL(cls);
     CALL(sgr0);
     n->am = true;
-    n->pnm = false;
+    n->pnm = n->paste = false;
+    n->syncat = 0;
     n->pri.vis = n->alt.vis = 1;
     n->s = &n->pri;
+    n->dirty = true;
     wsetscrreg(n->pri.win, 0, MAX(SCROLLBACK, n->h) - 1);
     wsetscrreg(n->alt.win, 0, n->h - 1);
     for (int i = 0; i < n->ntabs; i++)
@@ -438,25 +851,60 @@ HANDLER(mode) /* Set or Reset Mode */
         case 25: s->vis = set? 1 : 0;       break;
         case 34: s->vis = set? 1 : 2;       break;
         case 1048: CALL((set? sc : rc));    break;
+        case 2004: n->paste = set;          break;
+        case 2026: n->syncat = !set? 0 : n->syncat? n->syncat : now(); break;
         case 1049:
             CALL((set? sc : rc)); /* fall-through */
         case 47: case 1047: if (set && n->s != &n->alt){
                 n->s = &n->alt;
+                n->dirty = true;
                 CALL(cls);
-            } else if (!set && n->s != &n->pri)
+            } else if (!set && n->s != &n->pri){
                 n->s = &n->pri;
+                n->dirty = true;
+            }
             break;
     }
 ENDHANDLER
 
+static int
+sgrcolor(VTPARSER *v, int argc, int *argv, int *i, int c)
+{
+    /* Parse the color following argument *i of SGR 38 or 48, returning
+     * the host color for it, or c if it's no good. Colon-separated
+     * subparameters end at the next semicolon and may have a color space
+     * before RGB values; the older semicolon-separated forms have a fixed
+     * number of arguments.
+     */
+    int j = *i + 1, k = j, m = P0(j);
+    if (v->subs & (1u << j)){
+        while (k + 1 < argc && (v->subs & (1u << (k + 1))))
+            k++;
+        if (m == 2 && k - j >= 4)
+            j++; /* skip the color space */
+        if ((m == 5 && k - j < 1) || (m == 2 && k - j < 3))
+            m = 0;
+    } else
+        k = m == 5? j + 1 : m == 2? j + 3 : j;
+
+    *i = k;
+    switch (m){
+        case 5: return mtm_color(MIN(P0(j + 1), 255));
+        case 2: return mtm_color(0x1000000 | MIN(P0(j + 1), 255) << 16
+                                 | MIN(P0(j + 2), 255) << 8
+                                 | MIN(P0(j + 3), 255));
+    }
+    return c;
+}
+
 HANDLER(sgr) /* SGR - Select Graphic Rendition */
-    bool doc = false, do8 = COLORS >= 8, do16 = COLORS >= 16, do256 = COLORS >= 256;
+    bool doc = false, do8 = COLORS >= 8, do16 = COLORS >= 16;
     if (!argc)
         CALL(sgr0);
 
-    short bg = s->bg, fg = s->fg;
-    for (int i = 0; i < argc; i++) switch (P0(i)){
-        case  0:  CALL(sgr0);                                              break;
+    int bg = s->bg, fg = s->fg;
+    for (int i = 0; i < argc; i++) if (!(v->subs & (1u << i))) switch (P0(i)){
+        case  0:  CALL(sgr0); fg = bg = -1;                   doc = false; break;
         case  1:  wattron(win,  A_BOLD);                                   break;
         case  2:  wattron(win,  A_DIM);                                    break;
         case  4:  wattron(win,  A_UNDERLINE);                              break;
@@ -475,7 +923,7 @@ HANDLER(sgr) /* SGR - Select Graphic Rendition */
         case 35:  fg = COLOR_MAGENTA;                         doc = do8;   break;
         case 36:  fg = COLOR_CYAN;                            doc = do8;   break;
         case 37:  fg = COLOR_WHITE;                           doc = do8;   break;
-        case 38:  fg = P0(i+1) == 5? P0(i+2) : s->fg; i += 2; doc = do256; break;
+        case 38:  fg = sgrcolor(v, argc, argv, &i, fg);       doc = do8;   break;
         case 39:  fg = -1;                                    doc = true;  break;
         case 40:  bg = COLOR_BLACK;                           doc = do8;   break;
         case 41:  bg = COLOR_RED;                             doc = do8;   break;
@@ -485,7 +933,7 @@ HANDLER(sgr) /* SGR - Select Graphic Rendition */
         case 45:  bg = COLOR_MAGENTA;                         doc = do8;   break;
         case 46:  bg = COLOR_CYAN;                            doc = do8;   break;
         case 47:  bg = COLOR_WHITE;                           doc = do8;   break;
-        case 48:  bg = P0(i+1) == 5? P0(i+2) : s->bg; i += 2; doc = do256; break;
+        case 48:  bg = sgrcolor(v, argc, argv, &i, bg);       doc = do8;   break;
         case 49:  bg = -1;                                    doc = true;  break;
         case 90:  fg = COLOR_BLACK;                           doc = do16;  break;
         case 91:  fg = COLOR_RED;                             doc = do16;  break;
@@ -513,7 +961,9 @@ HANDLER(sgr) /* SGR - Select Graphic Rendition */
 	#endif
     }
     if (doc){
-        int p = mtm_alloc_pair(s->fg = fg, s->bg = bg);
+        s->fg = fg;
+        s->bg = bg;
+        int p = getpair(s);
         wcolor_set(win, p, NULL);
         cchar_t c;
         setcchar(&c, L" ", A_NORMAL, p, NULL);
@@ -527,7 +977,10 @@ HANDLER(cr) /* CR - Carriage Return */
 ENDHANDLER
 
 HANDLER(ind) /* IND - Index */
+    if (y == bot - 1)
+        scrolled(n, 1);
     y == (bot - 1)? scroll(win) : wmove(win, py + 1, x);
+    n->st.scrolls += y == (bot - 1);
 ENDHANDLER
 
 HANDLER(nel) /* NEL - Next Line */
@@ -547,7 +1000,10 @@ HANDLER(cnl) /* CNL - Cursor Next Line */
 ENDHANDLER
 
 HANDLER(print) /* Print a character to the terminal */
-    if (wcwidth(w) < 0)
+    if (w < MAXMAP && n->gc[w])
+        w = n->gc[w];
+    int cw = charwidth(w);
+    if (cw < 0)
         return;
 
     if (s->insert)
@@ -561,11 +1017,9 @@ HANDLER(print) /* Print a character to the terminal */
         y -= tos;
     }
 
-    if (w < MAXMAP && n->gc[w])
-        w = n->gc[w];
     n->repc = w;
 
-    if (x == mx - wcwidth(w)){
+    if (x == mx - cw){
         s->xenl = true;
         wins_nwstr(win, &w, 1);
     } else
@@ -574,8 +1028,54 @@ HANDLER(print) /* Print a character to the terminal */
 } /* no ENDHANDLER because we don't want to reset repc */
 
 HANDLER(rep) /* REP - Repeat Character */
-    for (int i = 0; i < P1(0) && n->repc; i++)
-        print(v, p, n->repc, 0, 0, NULL, NULL);
+    /* The first on each line goes through print, to wrap and the like; the
+     * rest that fit before the last column are written all at once, and so
+     * are whole lines, scrolling once for all of them. */
+    wchar_t c = n->repc, b[MAXREP];
+    for (int k = P1(0); k > 0 && c; ){
+        print(v, p, c, 0, 0, NULL, NULL);
+        c = n->repc;
+        k--;
+
+        wchar_t m = c < MAXMAP && n->gc[c]? n->gc[c] : c;
+        int cw = charwidth(m), r = 0;
+        getyx(win, py, px);
+        y = py - tos;
+        if (cw == 1 && s->xenl && n->am && !s->insert && k >= mx
+         && y >= top && y < bot){
+            int q = k / mx, down = MIN(q, bot - 1 - y), up = q - down;
+            int rt = 0, rb = 0; /* the region in the pad, scrollback and all */
+            cchar_t f;
+            wgetscrreg(win, &rt, &rb);
+            setcchar(&f, (wchar_t []){m, 0}, A_NORMAL, 0, NULL);
+            if (up > 0){
+                scrolled(n, up);
+                wscrl(win, MIN(up, rb - rt + 1));
+                n->st.scrolls += up;
+            }
+            for (int i = MAX(py + down - q + 1, rt); i <= py + down; i++)
+                setcells(n, i, 0, mx, f, false);
+            wmove(win, tos + y + down, mx - 1);
+            n->gc = n->gs;
+            c = m;
+            k -= q * mx;
+            continue;
+        }
+
+        if (cw > 0 && !s->xenl)
+            r = MIN(MIN(k, MAXREP), (mx - 1 - px) / cw);
+        for (int i = 0; i < r; i++)
+            b[i] = c = m;
+        if (r > 0 && s->insert){
+            int cells = r * cw;
+            ich(v, p, 0, 0, 1, &cells, NULL);
+        }
+        if (r > 0){
+            waddnwstr(win, b, r);
+            n->gc = n->gs;
+            k -= r;
+        }
+    }
 ENDHANDLER
 
 HANDLER(scs) /* Select Character Set */
@@ -660,6 +1160,7 @@ setupevents(NODE *n)
     vtonevent(&n->vp, VTPARSER_CSI,     L'l', mode);
     vtonevent(&n->vp, VTPARSER_CSI,     L'm', sgr);
     vtonevent(&n->vp, VTPARSER_CSI,     L'n', dsr);
+    vtonevent(&n->vp, VTPARSER_CSI,     L'p', decrqm);
     vtonevent(&n->vp, VTPARSER_CSI,     L'r', csr);
     vtonevent(&n->vp, VTPARSER_CSI,     L's', sc);
     vtonevent(&n->vp, VTPARSER_CSI,     L'u', rc);
@@ -725,19 +1226,33 @@ freenode(NODE *n, bool recurse) /* Free a node. */
     if (n){
         if (lastfocused == n)
             lastfocused = NULL;
+        if (searching == n)
+            searching = NULL;
+        if (naming == n)
+            naming = NULL;
+        dropexports(n);
+        stoplog(n);
+        for (int i = 0; n->ix && i < SCROLLBACK; i++)
+            free(n->ix[i].s);
+        free(n->ix);
+        free(n->row);
         if (n->pri.win)
             delwin(n->pri.win);
         if (n->alt.win)
             delwin(n->alt.win);
-        if (recurse)
-            freenode(n->c1, true);
-        if (recurse)
-            freenode(n->c2, true);
+        for (int i = 0; recurse && i < n->nc; i++)
+            freenode(n->c[i], true);
+        free(n->c);
         if (n->pt >= 0){
+            unwatch(n);
             close(n->pt);
-            FD_CLR(n->pt, &fds);
         }
+        if (n->t == VIEW)
+            addstats(&totals, n);
+        dropobservers(n);
         free(n->tabs);
+        free(n->rb);
+        free(n->wq);
         free(n);
     }
 }
@@ -747,7 +1262,8 @@ fixcursor(void) /* Move the terminal cursor to the active view. */
 {
     if (focused){
         int y, x;
-        curs_set(focused->s->off != focused->s->tos? 0 : focused->s->vis);
+        curs_set(searching? 1 : focused->s->off != focused->s->tos? 0
+                                                       : focused->s->vis);
         getyx(focused->s->win, y, x);
         y = MIN(MAX(y, focused->s->tos), focused->s->tos + focused->h - 1);
         wmove(focused->s->win, y, x);
@@ -765,6 +1281,122 @@ getterm(void)
     return DEFAULT_TERMINAL;
 }
 
+static void
+poke(int fd) /* Wake up whoever is waiting on the other end of a pipe. */
+{
+    safewrite(fd, "", 1);
+}
+
+static void
+fill(NODE *n) /* Read pending output from a view's pty into its ring. */
+{
+    ssize_t r = ringfill(n->rb, n->pt);
+    if (r > 0){ /* the input thread might be doing this */
+        __atomic_add_fetch(&n->st.reads, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&n->st.bytes, r, __ATOMIC_RELAXED);
+        traceevent(EV_READ, n->id, r);
+    }
+    if (r == 0 || (r < 0 && errno != EINTR && errno != EWOULDBLOCK))
+        ringclose(n->rb);
+}
+
+static void *
+readptys(void *arg) /* Fill the rings of all views. Runs on its own thread. */
+{
+    char b[100];
+    (void)arg;
+    while (true){
+        fd_set sfds;
+        int m = pokefd[0];
+        FD_ZERO(&sfds);
+        FD_SET(pokefd[0], &sfds);
+
+        pthread_mutex_lock(&viewlock);
+        for (int i = 0; i <= maxview; i++) if (views[i] && !ringclosed(views[i]->rb)
+                                              && ringroom(views[i]->rb)){
+            FD_SET(i, &sfds);
+            m = MAX(m, i);
+        }
+        pthread_mutex_unlock(&viewlock);
+
+        if (select(m + 1, &sfds, NULL, NULL, NULL) < 0)
+            continue;
+        if (FD_ISSET(pokefd[0], &sfds))
+            while (read(pokefd[0], b, sizeof(b)) > 0)
+                ;
+
+        bool woke = false;
+        pthread_mutex_lock(&viewlock);
+        for (int i = 0; i <= maxview; i++) if (views[i] && FD_ISSET(i, &sfds)){
+            fill(views[i]);
+            woke = true;
+        }
+        pthread_mutex_unlock(&viewlock);
+        if (woke)
+            poke(wakefd[1]);
+    }
+    return NULL;
+}
+
+static bool
+spawn(void *(*f)(void *), void *a) /* Start a thread that ignores signals. */
+{
+    pthread_t t;
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int r = pthread_create(&t, NULL, f, a);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (r == 0)
+        pthread_detach(t);
+    return r == 0;
+}
+
+static void
+startio(void) /* Start the input thread. */
+{
+    if (pipe(wakefd) != 0 || pipe(pokefd) != 0)
+        quit(EXIT_FAILURE, "could not create pipes");
+    for (int i = 0; i < 2; i++){
+        fcntl(wakefd[i], F_SETFL, O_NONBLOCK);
+        fcntl(pokefd[i], F_SETFL, O_NONBLOCK);
+        fcntl(wakefd[i], F_SETFD, FD_CLOEXEC);
+        fcntl(pokefd[i], F_SETFD, FD_CLOEXEC);
+    }
+    FD_SET(wakefd[0], &fds);
+    nfds = MAX(nfds, wakefd[0]);
+    if (!spawn(readptys, NULL))
+        quit(EXIT_FAILURE, "could not start thread");
+}
+
+static void
+watch(NODE *n) /* Start reading a view's pty. */
+{
+    fcntl(n->pt, F_SETFL, O_NONBLOCK);
+    nfds = MAX(nfds, n->pt); /* its input is written from here either way */
+    if (IO_THREAD){
+        pthread_mutex_lock(&viewlock);
+        views[n->pt] = n;
+        maxview = MAX(maxview, n->pt);
+        pthread_mutex_unlock(&viewlock);
+        poke(pokefd[1]);
+    } else
+        FD_SET(n->pt, &fds);
+}
+
+static void
+unwatch(NODE *n) /* Stop reading a view's pty. */
+{
+    if (n->pt >= FD_SETSIZE) /* it never was */
+        return;
+    if (IO_THREAD){
+        pthread_mutex_lock(&viewlock);
+        views[n->pt] = NULL;
+        pthread_mutex_unlock(&viewlock);
+    } else
+        FD_CLR(n->pt, &fds);
+}
+
 static NODE *
 newview(NODE *p, int y, int x, int h, int w) /* Open a new view. */
 {
@@ -776,9 +1408,14 @@ newview(NODE *p, int y, int x, int h, int w) /* Open a new view. */
     SCRN *pri = &n->pri, *alt = &n->alt;
     pri->win = newpad(MAX(h, SCROLLBACK), w);
     alt->win = newpad(h, w);
-    if (!pri->win || !alt->win)
+    n->rb = newring(RINGSIZE);
+    n->wq = newring(INPUT_BUFFER);
+    n->ix = calloc(SCROLLBACK, sizeof(TEXT));
+    if (!pri->win || !alt->win || !n->rb || !n->wq || !n->ix)
         return freenode(n, false), NULL;
     pri->tos = pri->off = MAX(0, SCROLLBACK - h);
+    pri->pfg = alt->pfg = INT_MIN; /* no pair looked up yet */
+    n->pushed = n->kept = SCROLLBACK; /* so no line number is negative */
     n->s = pri;
 
     nodelay(pri->win, TRUE); nodelay(alt->win, TRUE);
@@ -787,6 +1424,7 @@ newview(NODE *p, int y, int x, int h, int w) /* Open a new view. */
 
     setupevents(n);
     ris(&n->vp, n, L'c', 0, 0, NULL, NULL);
+    n->id = ++lastid;
 
     pid_t pid = forkpty(&n->pt, NULL, NULL, &ws);
     if (pid < 0){
@@ -798,15 +1436,20 @@ newview(NODE *p, int y, int x, int h, int w) /* Open a new view. */
         snprintf(buf, sizeof(buf) - 1, "%lu", (unsigned long)getppid());
         setsid();
         setenv("MTM", buf, 1);
+        snprintf(buf, sizeof(buf) - 1, "%d", n->id);
+        setenv("MTM_PANE", buf, 1);
         setenv("TERM", getterm(), 1);
         signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
         execl(getshell(), getshell(), NULL);
         return NULL;
+    } else if (n->pt >= FD_SETSIZE){ /* too many to select(2) from */
+        if (!p)
+            fputs("too many open files\n", stderr);
+        return freenode(n, false), NULL;
     }
 
-    FD_SET(n->pt, &fds);
-    fcntl(n->pt, F_SETFL, O_NONBLOCK);
-    nfds = n->pt > nfds? n->pt : nfds;
+    watch(n);
     return n;
 }
 
@@ -814,13 +1457,19 @@ static NODE *
 newcontainer(Node t, NODE *p, int y, int x, int h, int w,
              NODE *c1, NODE *c2) /* Create a new container */
 {
+    /* It takes c1's place, and c1 gives half its room to c2. */
+    int room = (t == HORIZONTAL? w : h) - 1;
     NODE *n = newnode(t, p, y, x, h, w);
-    if (!n)
-        return NULL;
+    if (!n || !(n->c = malloc(2 * sizeof(NODE *))))
+        return freenode(n, false), NULL;
 
-    n->c1 = c1;
-    n->c2 = c2;
+    n->c[0] = c1;
+    n->c[1] = c2;
+    n->nc = 2;
+    n->wt = c1->wt;
     c1->p = c2->p = n;
+    c1->wt = MAX((room + 1) / 2, 1);
+    c2->wt = MAX(room - c1->wt, 1);
 
     reshapechildren(n);
     return n;
@@ -835,7 +1484,7 @@ focus(NODE *n) /* Focus a node. */
         lastfocused = focused;
         focused = n;
     } else
-        focus(n->c1? n->c1 : n->c2);
+        focus(n->nc? n->c[0] : NULL);
 }
 
 #define ABOVE(n) n->y - 2, n->x + n->w / 2
@@ -846,51 +1495,230 @@ focus(NODE *n) /* Focus a node. */
 static NODE *
 findnode(NODE *n, int y, int x) /* Find the node enclosing y,x. */
 {
+    /* Children are kept in order, so the only one that can enclose y,x is
+     * the last to start at or before it. Each one's right or bottom edge
+     * takes in the divider after it. */
     #define IN(n, y, x) (y >= n->y && y <= n->y + n->h && \
                          x >= n->x && x <= n->x + n->w)
-    if (IN(n, y, x)){
-        if (n->c1 && IN(n->c1, y, x))
-            return findnode(n->c1, y, x);
-        if (n->c2 && IN(n->c2, y, x))
-            return findnode(n->c2, y, x);
-        return n;
+    while (n && IN(n, y, x) && n->nc){
+        int lo = 0, hi = n->nc - 1, at = n->t == HORIZONTAL? x : y;
+        while (lo < hi){
+            int mid = (lo + hi + 1) / 2;
+            if ((n->t == HORIZONTAL? n->c[mid]->x : n->c[mid]->y) <= at)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        if (!IN(n->c[lo], y, x))
+            return n;
+        n = n->c[lo];
     }
-    return NULL;
+    return n && IN(n, y, x)? n : NULL;
+}
+
+static int
+childindex(const NODE *p, const NODE *c) /* Find where c is among p's. */
+{
+    int i = 0;
+    while (i < p->nc && p->c[i] != c)
+        i++;
+    return i;
+}
+
+static void
+fitweights(NODE *p) /* Weigh p's children by the room they have now. */
+{
+    /* With weights in cells, room can be moved from child to child, or
+     * from container to container, without disturbing any other. */
+    for (int i = 0; i < p->nc; i++)
+        p->c[i]->wt = MAX(p->t == HORIZONTAL? p->c[i]->w : p->c[i]->h, 1);
 }
 
 static void
 replacechild(NODE *n, NODE *c1, NODE *c2) /* Replace c1 of n with c2. */
 {
+    int i = n? childindex(n, c1) : 0;
     c2->p = n;
     if (!n){
         root = c2;
         reshape(c2, 0, 0, LINES, COLS);
-    } else if (n->c1 == c1)
-        n->c1 = c2;
-    else if (n->c2 == c1)
-        n->c2 = c2;
+    } else if (i < n->nc)
+        n->c[i] = c2;
 
     n = n? n : root;
     reshape(n, n->y, n->x, n->h, n->w);
-    draw(n);
+}
+
+static bool
+addchild(NODE *p, NODE *c, NODE *after) /* Add c to p, after a child. */
+{
+    /* c takes half of after's room, as if after had been split in two. */
+    int i = childindex(p, after) + 1;
+    NODE **a = realloc(p->c, (p->nc + 1) * sizeof(NODE *));
+    if (!a)
+        return false;
+
+    p->c = a;
+    fitweights(p);
+    memmove(a + i + 1, a + i, (p->nc - i) * sizeof(NODE *));
+    a[i] = c;
+    p->nc++;
+    c->p = p;
+    c->wt = MAX(after->wt - 1 - after->wt / 2, 1);
+    after->wt = MAX(after->wt / 2, 1);
+    reshape(p, p->y, p->x, p->h, p->w);
+    return true;
+}
+
+static void
+splice(NODE *g, NODE *p, NODE *o) /* Put o's children in g, in p's place. */
+{
+    /* o goes the same way as g, so its children can be g's; in cells,
+     * their weights and the dividers between them add up to p's. */
+    int i = childindex(g, p);
+    NODE **a = realloc(g->c, (g->nc + o->nc - 1) * sizeof(NODE *));
+    if (!a){
+        replacechild(g, p, o);
+        return;
+    }
+
+    g->c = a;
+    fitweights(g);
+    fitweights(o);
+    memmove(a + i + o->nc, a + i + 1, (g->nc - i - 1) * sizeof(NODE *));
+    memcpy(a + i, o->c, o->nc * sizeof(NODE *));
+    g->nc += o->nc - 1;
+    for (int j = 0; j < o->nc; j++)
+        o->c[j]->p = g;
+    o->nc = 0;
+    freenode(o, false);
+    reshape(g, g->y, g->x, g->h, g->w);
 }
 
 static void
-removechild(NODE *p, const NODE *c) /* Replace p with other child. */
+removechild(NODE *p, const NODE *c) /* Take c out of p. */
 {
-    replacechild(p->p, p, c == p->c1? p->c2 : p->c1);
+    /* Its neighbor gets its room. A container left with one child is
+     * replaced by it, and if that child goes the same way as its new
+     * parent, its children are moved up, to keep the tree shallow. */
+    int i = childindex(p, c);
+    NODE *g = p->p, *o = NULL;
+    fitweights(p);
+    p->c[i > 0? i - 1 : i + 1]->wt += c->wt + 1;
+    memmove(p->c + i, p->c + i + 1, (p->nc - i - 1) * sizeof(NODE *));
+    if (--p->nc > 1){
+        reshape(p, p->y, p->x, p->h, p->w);
+        return;
+    }
+
+    o = p->c[0];
+    o->wt = p->wt;
+    if (g && g->t == o->t)
+        splice(g, p, o);
+    else
+        replacechild(g, p, o);
     freenode(p, false);
 }
 
+static void
+usedesk(DESK *d) /* Make d the current window, without showing it. */
+{
+    if (desk){
+        desk->root = root;
+        desk->focused = focused;
+        desk->lastfocused = lastfocused;
+        desk->zoomed = zoomed;
+    }
+    desk = d;
+    root = d->root;
+    focused = d->focused;
+    lastfocused = d->lastfocused;
+    zoomed = d->zoomed;
+}
+
+static bool
+within(const NODE *c, const NODE *n) /* Is c n, or somewhere inside it? */
+{
+    while (c && c != n)
+        c = c->p;
+    return c != NULL;
+}
+
+static DESK *
+deskof(NODE *n) /* Find the window n is in. */
+{
+    DESK *d = desks;
+    while (n->p)
+        n = n->p;
+    while (d && ROOT(d) != n)
+        d = d->next;
+    return d;
+}
+
+static void
+layout(void) /* Fit the current window, or its zoomed view, to the screen. */
+{
+    if (zoomed)
+        reshape(zoomed, 0, 0, LINES, COLS);
+    else
+        reshape(root, 0, 0, LINES, COLS);
+}
+
+static void
+unzoom(void) /* Put the zoomed view back in its place. */
+{
+    if (zoomed){
+        zoomed = NULL;
+        layout();
+        redraw(root); /* it was covering everything else */
+    }
+}
+
+static void
+closedesk(DESK *d) /* Close the current window, d, which is empty. */
+{
+    DESK **p = &desks;
+    while (*p != d)
+        p = &(*p)->next;
+    *p = d->next;
+    desk = NULL;
+    usedesk(d->next? d->next : desks);
+    free(d);
+}
+
 static void
 deletenode(NODE *n) /* Delete a node. */
 {
-    if (!n || !n->p)
-        quit(EXIT_SUCCESS, NULL);
-    if (n == focused)
-        focus(n->p->c1 == n? n->p->c2 : n->p->c1);
+    /* The view may be in a window other than the current one, if the
+     * program in it exited; if so, that window is current for a moment. */
+    DESK *d = n? deskof(n) : NULL, *was = desk;
+    if (!n)
+        return;
+    if (!n->p){
+        if (desks == d && !d->next)
+            quit(EXIT_SUCCESS, NULL);
+        usedesk(d);
+        freenode(n, true);
+        closedesk(d);
+        if (was != d)
+            usedesk(was);
+        else{
+            layout();
+            redraw(root);
+        }
+        return;
+    }
+
+    usedesk(d);
+    if (within(zoomed, n))
+        unzoom();
+    if (n == focused){ /* focus the neighbor that gets its room */
+        int i = childindex(n->p, n);
+        focus(n->p->c[i > 0? i - 1 : i + 1]);
+    }
     removechild(n->p, n);
     freenode(n, true);
+    usedesk(was);
 }
 
 static void
@@ -898,7 +1726,6 @@ reshapeview(NODE *n, int d, int ow) /* Reshape a view. */
 {
     int oy, ox;
     bool *tabs = newtabs(n->w, ow, n->tabs);
-    struct winsize ws = {.ws_row = n->h, .ws_col = n->w};
 
     if (tabs){
         free(n->tabs);
@@ -917,30 +1744,59 @@ reshapeview(NODE *n, int d, int ow) /* Reshape a view. */
         wmove(n->s->win, oy + d, ox);
         wscrl(n->s->win, -d);
     }
-    doupdate();
-    refresh();
-    ioctl(n->pt, TIOCSWINSZ, &ws);
+    n->dirty = true;
+    n->drawn = NULL;
+    observe(n, NULL, 0);
+    if (!d && n->w == ow) /* it only moved */
+        return;
+    forget(n);
+    n->winch = true; /* once things settle down */
+    winchdue = now() + RESIZE_DELAY;
+}
+
+static void
+sendsizes(NODE *n) /* Tell the programs in n their new sizes. */
+{
+    if (n && n->t == VIEW && n->winch){
+        struct winsize ws = {.ws_row = n->h, .ws_col = n->w};
+        ioctl(n->pt, TIOCSWINSZ, &ws);
+        n->winch = false;
+    } else if (n && n->t != VIEW){
+        for (int i = 0; i < n->nc; i++)
+            sendsizes(n->c[i]);
+    }
 }
 
 static void
 reshapechildren(NODE *n) /* Reshape all children of a view. */
 {
-    if (n->t == HORIZONTAL){
-        int i = n->w % 2? 0 : 1;
-        reshape(n->c1, n->y, n->x, n->h, n->w / 2);
-        reshape(n->c2, n->y, n->x + n->w / 2 + 1, n->h, n->w / 2 - i);
-    } else if (n->t == VERTICAL){
-        int i = n->h % 2? 0 : 1;
-        reshape(n->c1, n->y, n->x, n->h / 2, n->w);
-        reshape(n->c2, n->y + n->h / 2 + 1, n->x, n->h / 2 - i, n->w);
+    /* The room between the dividers is shared out by weight, rounding
+     * each child's far edge up, so that two children of equal weight
+     * split it the way halving always has. */
+    long long total = 0, sum = 0;
+    int room = (n->t == HORIZONTAL? n->w : n->h) - (n->nc - 1), at = 0;
+    for (int i = 0; i < n->nc; i++)
+        total += n->c[i]->wt;
+    for (int i = 0; i < n->nc; i++){
+        sum += n->c[i]->wt;
+        int end = total > 0? (int)((room * sum + total - 1) / total) : room;
+        if (n->t == HORIZONTAL)
+            reshape(n->c[i], n->y, n->x + at + i, n->h, end - at);
+        else
+            reshape(n->c[i], n->y + at + i, n->x, end - at, n->w);
+        at = end;
     }
 }
 
 static void
 reshape(NODE *n, int y, int x, int h, int w) /* Reshape a node. */
 {
+    /* Nothing is drawn here: the whole layout is worked out first, and
+     * drawn once by the run loop. */
     if (n->y == y && n->x == x && n->h == h && n->w == w && n->t == VIEW)
         return;
+    if (n == zoomed && (y || x || h != LINES || w != COLS))
+        return; /* it keeps the screen until it's put back */
 
     int d = n->h - h;
     int ow = n->w;
@@ -953,188 +1809,2041 @@ reshape(NODE *n, int y, int x, int h, int w) /* Reshape a node. */
         reshapeview(n, d, ow);
     else
         reshapechildren(n);
-    draw(n);
+}
+
+static void
+hint(NODE *n) /* Tell the renderer how far n has scrolled since it was drawn. */
+{
+    /* Scrolling the pad and moving through the scrollback both move what's
+     * shown. If only part of it was scrolled, it had better not have moved
+     * through the scrollback too. */
+    SCRN *s = n->s;
+    int d = s->off - n->drawnoff, top = 0, bot = n->h - 1;
+    if (s->up){
+        top = MAX(s->st - s->off, 0);
+        bot = MIN(s->sb - s->off, n->h - 1);
+    }
+    if (n->drawn == s && !s->tangled && (!d || (!top && bot == n->h - 1))
+     && top < bot)
+        scrollhint(n->y + top, n->x, bot - top + 1, n->w, s->up + d);
+    n->drawn = s;
+    n->drawnoff = s->off;
+    n->pri.up = n->alt.up = 0;
+    n->pri.tangled = n->alt.tangled = false;
 }
 
 static void
 drawchildren(const NODE *n) /* Draw all children of n. */
 {
-    draw(n->c1);
-    if (n->t == HORIZONTAL)
-        mvvline(n->y, n->x + n->w / 2, ACS_VLINE, n->h);
-    else
-        mvhline(n->y + n->h / 2, n->x, ACS_HLINE, n->w);
-    wnoutrefresh(stdscr);
-    draw(n->c2);
+    /* Curses copies each line of stdscr from its first change to its last,
+     * so dividers have to be copied one at a time, or what's between them
+     * would be copied too. */
+    draw(n->c[0]);
+    for (int i = 1; i < n->nc; i++){
+        if (n->t == HORIZONTAL)
+            mvvline(n->y, n->c[i]->x - 1, ACS_VLINE, n->h);
+        else
+            mvhline(n->c[i]->y - 1, n->x, ACS_HLINE, n->w);
+        wnoutrefresh(stdscr);
+        draw(n->c[i]);
+    }
+}
+
+static bool
+held(NODE *n) /* Is n in the middle of a synchronized update? */
+{
+    long long t = n->syncat? n->syncat + SYNC_TIMEOUT : 0;
+    if (t && t <= now())
+        n->syncat = t = 0; /* the application took too long; give up */
+    if (t)
+        syncdue = syncdue? MIN(syncdue, t) : t;
+    return t;
 }
 
 static void
 draw(NODE *n) /* Draw a node. */
 {
-    if (n->t == VIEW)
+    if (n->t == VIEW && held(n))
+        return;
+
+    /* Copying a pad compares every cell in it, so skip views that haven't
+     * changed since they were last drawn. The focused view is always drawn
+     * so that the cursor ends up in the right place. */
+    if (n->t == VIEW && (n->dirty || n == focused || is_wintouched(n->s->win))){
+        if (direct)
+            hint(n);
         pnoutrefresh(n->s->win, n->s->off, 0, n->y, n->x,
                      n->y + n->h - 1, n->x + n->w - 1);
-    else
+        untouchwin(n->s->win);
+        n->dirty = false;
+        n->st.renders++;
+        if (n == searching)
+            drawsearch(n);
+        else if (n == naming)
+            drawprompt(n, namingfor == NAME_LOG? "log to: "
+                        : namingfor == NAME_SGR? "export with attributes to: "
+                        : "export to: ", "");
+    } else if (n->t != VIEW)
         drawchildren(n);
 }
 
+static void
+redraw(NODE *n) /* Redraw all of n from scratch. */
+{
+    if (n->t == VIEW)
+        n->dirty = true;
+    else{
+        for (int i = 0; i < n->nc; i++)
+            redraw(n->c[i]);
+    }
+    if (n == root){
+        clearok(curscr, TRUE);
+        forgetscreen();
+    }
+}
+
 static void
 split(NODE *n, Node t) /* Split a node. */
 {
+    /* Splitting the way n's container already goes adds a view beside n
+     * in it; otherwise, n and the new view get a container of their own. */
     int nh = t == VERTICAL? (n->h - 1) / 2 : n->h;
     int nw = t == HORIZONTAL? (n->w) / 2 : n->w;
-    NODE *p = n->p;
+    NODE *p = n->p, *c = NULL;
     NODE *v = newview(NULL, 0, 0, MAX(0, nh), MAX(0, nw));
     if (!v)
         return;
 
-    NODE *c = newcontainer(t, n->p, n->y, n->x, n->h, n->w, n, v);
-    if (!c){
+    if (p && p->t == t){
+        if (!addchild(p, v, n)){
+            freenode(v, false);
+            return;
+        }
+    } else if ((c = newcontainer(t, n->p, n->y, n->x, n->h, n->w, n, v)))
+        replacechild(p, n, c);
+    else{
         freenode(v, false);
         return;
     }
-
-    replacechild(p, n, c);
     focus(v);
-    draw(p? p : root);
 }
 
-static bool
-getinput(NODE *n, fd_set *f) /* Recursively check all ptty's for input. */
+static int
+span(const NODE *n, Node t) /* How many views n has side by side along t. */
 {
-    if (n && n->c1 && !getinput(n->c1, f))
-        return false;
-
-    if (n && n->c2 && !getinput(n->c2, f))
-        return false;
+    int s = n->t == VIEW;
+    for (int i = 0; i < n->nc; i++)
+        s = n->t == t? s + span(n->c[i], t) : MAX(s, span(n->c[i], t));
+    return s;
+}
 
-    if (n && n->t == VIEW && n->pt > 0 && FD_ISSET(n->pt, f)){
-        ssize_t r = read(n->pt, iobuf, sizeof(iobuf));
-        if (r > 0)
-            vtwrite(&n->vp, iobuf, r);
-        if (r <= 0 && errno != EINTR && errno != EWOULDBLOCK)
-            return deletenode(n), false;
+static void
+balance(NODE *n) /* Share out the room in n as evenly as it will go. */
+{
+    /* Each child is weighed by how many views it has side by side, so
+     * that every view in a row or column gets the same room. */
+    for (int i = 0; i < n->nc; i++){
+        n->c[i]->wt = span(n->c[i], n->t);
+        balance(n->c[i]);
     }
+}
 
-    return true;
+static NODE *
+findview(NODE *n, int id) /* Find the view with the given id. */
+{
+    NODE *v = NULL;
+    if (n && n->t == VIEW)
+        return n->id == id? n : NULL;
+    for (int i = 0; n && !v && i < n->nc; i++)
+        v = findview(n->c[i], id);
+    return v;
 }
 
 static void
-scrollback(NODE *n)
+observe(NODE *n, const char *s, size_t l) /* n has changed, maybe with s. */
 {
-    n->s->off = MAX(0, n->s->off - n->h / 2);
+    /* Observers of a view are only touched by whoever is processing it. */
+    for (OBSERVER *o = observers; o; o = o->next) if (o->n == n){
+        o->stale = true;
+        if (s && !o->screen && !o->lost)
+            o->lost = !ringput(o->q, s, l); /* catch up with a picture */
+    }
 }
 
 static void
-scrollforward(NODE *n)
+dropobservers(NODE *n) /* Hang up on n's observers. */
 {
-    n->s->off = MIN(n->s->tos, n->s->off + n->h / 2);
+    for (OBSERVER *o = observers; o; o = o->next) if (o->n == n){
+        o->n = NULL;
+        o->dead = true;
+    }
 }
 
 static void
-scrollbottom(NODE *n)
+putcolor(FILE *f, int c, int base) /* Write SGR arguments for a color. */
 {
-    n->s->off = n->s->tos;
+    if (c >= 0 && c < 8)
+        fprintf(f, ";%d", base + c);
+    else if (c >= 0 && c < 256)
+        fprintf(f, ";%d;5;%d", base + 8, c);
+    else if (c >= 0)
+        fprintf(f, ";%d;2;%d;%d;%d", base + 8,
+                c >> 16 & 0xff, c >> 8 & 0xff, c & 0xff);
 }
 
 static void
-sendarrow(const NODE *n, const char *k)
+putattrs(FILE *f, attr_t a, short p) /* Write SGR for a cell's rendition. */
 {
-    char buf[100] = {0};
-    snprintf(buf, sizeof(buf) - 1, "\033%s%s", n->pnm? "O" : "[", k);
-    SEND(n, buf);
+    static const struct{ attr_t a; int n; } sgrs[] ={
+        {A_BOLD, 1}, {A_DIM, 2}, {A_UNDERLINE, 4}, {A_BLINK, 5},
+        {A_REVERSE, 7}, {A_INVIS, 8},
+        #if defined(A_ITALIC) && !defined(NO_ITALICS)
+        {A_ITALIC, 3},
+        #endif
+    };
+    int fg = -1, bg = -1;
+    #if NCURSES_EXT_COLORS
+    extended_pair_content(p, &fg, &bg);
+    #else
+    short sfg = -1, sbg = -1;
+    pair_content(p, &sfg, &sbg);
+    fg = sfg; bg = sbg;
+    #endif
+
+    fputs("\033[0", f);
+    for (size_t i = 0; i < sizeof(sgrs) / sizeof(sgrs[0]); i++)
+        if (a & sgrs[i].a)
+            fprintf(f, ";%d", sgrs[i].n);
+    putcolor(f, fg, 30);
+    putcolor(f, bg, 40);
+    fputc('m', f);
 }
 
-static bool
-handlechar(int r, int k) /* Handle a single input character. */
+static int
+putrow(FILE *f, WINDOW *win, int y, int w, bool trim, attr_t *la, short *lp,
+       mbstate_t *ms) /* Write a row of win with SGR; return the width used. */
+{
+    char mb[MB_LEN_MAX];
+    cchar_t c;
+    wchar_t wc[CCHARW_MAX + 1] = {0};
+    attr_t a = 0;
+    short p = 0;
+    while (trim && w > 0){ /* leave off blanks with nothing to show */
+        mvwin_wch(win, y, w - 1, &c);
+        getcchar(&c, wc, &a, &p, NULL);
+        if ((wc[0] && wc[0] != L' ') || p || (a & A_ATTRIBUTES & ~A_COLOR))
+            break;
+        w--;
+    }
+
+    for (int x = 0; x < w; x++){
+        memset(wc, 0, sizeof(wc));
+        mvwin_wch(win, y, x, &c);
+        getcchar(&c, wc, &a, &p, NULL);
+        a &= A_ATTRIBUTES & ~A_COLOR;
+        if (a != *la || p != *lp)
+            putattrs(f, *la = a, *lp = p);
+        for (int i = 0; i == 0 || (i < CCHARW_MAX && wc[i]); i++){
+            size_t k = wcrtomb(mb, wc[i]? wc[i] : L' ', ms);
+            if (k != (size_t)-1)
+                fwrite(mb, 1, k, f);
+        }
+        x += MAX(charwidth(wc[0]), 1) - 1;
+    }
+    return w;
+}
+
+static bool
+picture(OBSERVER *o) /* Queue a picture of an observed view's screen. */
+{
+    NODE *n = o->n;
+    SCRN *s = n->s;
+    char *b = NULL;
+    size_t l = 0;
+    int cy = 0, cx = 0;
+    attr_t la = 0;
+    short lp = -1;
+    mbstate_t ms;
+    FILE *f = open_memstream(&b, &l);
+    if (!f)
+        return false;
+
+    memset(&ms, 0, sizeof(ms));
+    getyx(s->win, cy, cx);
+    fputs(o->screen? "\033[H" : "\033[H\033[2J", f);
+    for (int y = 0; y < n->h; y++){
+        fprintf(f, "\033[%dH", y + 1);
+        putrow(f, s->win, s->tos + y, n->w, false, &la, &lp, &ms);
+    }
+    fprintf(f, "\033[0m\033[%d;%dH", cy - s->tos + 1, cx + 1);
+    wmove(s->win, cy, cx);
+
+    bool ok = fclose(f) == 0 && ringput(o->q, b, l);
+    free(b);
+    return ok;
+}
+
+static bool
+addobserver(int s, const char *m) /* Start sending a view to an observer. */
+{
+    NODE *n = NULL;
+    for (DESK *d = desks; d && !n; d = d->next)
+        n = findview(ROOT(d), atoi(m + 1));
+    OBSERVER *o = n? calloc(1, sizeof(OBSERVER)) : NULL;
+    if (!o || !(o->q = newring(OBSERVE_BUFFER)))
+        return free(o), false;
+
+    o->fd = s;
+    o->n = n;
+    o->screen = m[0] == SESSION_SCREEN;
+    o->stale = o->lost = true; /* start them off with a picture */
+    fcntl(s, F_SETFL, O_NONBLOCK);
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+    FD_SET(s, &fds);
+    nfds = MAX(nfds, s);
+    o->next = observers;
+    observers = o;
+    return true;
+}
+
+static void
+feedobservers(fd_set *r) /* Send observers what they're owed, nonblocking. */
+{
+    char b[100];
+    for (OBSERVER **p = &observers, *o = *p; o; o = *p){
+        NODE *n = o->n;
+        if (FD_ISSET(o->fd, r)){ /* observers don't talk, so they hung up */
+            ssize_t k = read(o->fd, b, sizeof(b));
+            o->dead |= k == 0 || (k < 0 && errno != EAGAIN && errno != EINTR);
+        }
+
+        bool want = o->screen? o->stale : o->lost;
+        if (n && n->syncat && n->syncat + SYNC_TIMEOUT > now())
+            want = false; /* wait for the application to finish */
+        if (!o->dead && want && !ringused(o->q)){
+            o->dead = !picture(o); /* if it can't fit now, it never will */
+            o->stale = o->lost = false;
+        }
+        if (!o->dead && ringused(o->q) && ringflush(o->q, o->fd) < 0
+         && errno != EAGAIN && errno != EINTR)
+            o->dead = true;
+
+        if (o->dead){
+            *p = o->next;
+            FD_CLR(o->fd, &fds);
+            close(o->fd);
+            free(o->q);
+            free(o);
+        } else
+            p = &o->next;
+    }
+}
+
+static size_t
+skim(NODE *n, const char *s, size_t l) /* Take in plain text at the start of s. */
+{
+    /* Plain text and line breaks on the main screen can go straight into the
+     * pad. The first time through we find how much of s is like that and how
+     * far it scrolls the screen; the second, having scrolled it that far all
+     * at once, we write only what will still be in the pad afterwards, in
+     * runs. The result is the same as printing it a character at a time.
+     */
+    SCRN *c = n->s;
+    WINDOW *win = c->win;
+    int top = 0, bot = 0, y = 0, x = 0, h = 0, w = 0, cx = 0, row = 0, sc = 0;
+    unsigned long long prints = 0, controls = 0;
+    unsigned char ch = 0;
+    bool xenl = false;
+    size_t k = 0, b = 0, e = l;
+    getyx(win, y, x);
+    getmaxyx(win, h, w);
+    wgetscrreg(win, &top, &bot);
+    if (c != &n->pri || top || bot != h - 1 || c->insert || !n->am
+     || n->gc != CSET_US || n->gs != CSET_US || !vtground(&n->vp))
+        return 0;
+
+    #define RUN()                                                          \
+        if (pass && row >= 0 && k > b)                                     \
+            mvwaddnstr(win, row, cx - (int)(k - b), s + b, (int)(k - b));  \
+        b = k;
+    for (int pass = 0; pass < 2; pass++){
+        cx = x; row = y - sc; xenl = c->xenl;
+        for (k = b = 0; k < e; k++){
+            ch = (unsigned char)s[k];
+            if (ch >= 0x20 && ch < 0x7f){
+                prints += !pass;
+                if (xenl){ /* wrap, as nel would */
+                    RUN();
+                    row++; cx = 0; xenl = false;
+                }
+                if (cx == w - 1){ /* the last column mustn't move the cursor */
+                    RUN();
+                    if (pass && row >= 0)
+                        mvwins_nwstr(win, row, cx, &(wchar_t){ch}, 1);
+                    b = k + 1;
+                    xenl = true;
+                } else
+                    cx++;
+            } else if (ch == '\r' || ch == '\n'){
+                RUN();
+                b = k + 1;
+                controls += !pass;
+                if (ch == '\r' || n->lnm){
+                    cx = 0;
+                    xenl = false;
+                }
+                row += ch == '\n';
+            } else{
+                e = k;
+                break;
+            }
+        }
+        RUN();
+
+        if (!pass && !e)
+            return 0;
+        if (!pass && (sc = MAX(row - (h - 1), 0)) > 0){
+            scrolled(n, sc);
+            sc >= h? werase(win) : wscrl(win, sc);
+            n->st.scrolls += sc;
+        }
+    }
+    #undef RUN
+
+    wmove(win, row, cx);
+    c->xenl = xenl;
+    ch = (unsigned char)s[e - 1];
+    n->repc = ch >= 0x20? ch : 0;
+    n->vp.counts[VTPARSER_PRINT] += prints;
+    n->vp.counts[VTPARSER_CONTROL] += controls;
+    n->st.skimmed += e;
+    return e;
+}
+
+static void
+feed(NODE *n, const char *s, size_t l) /* Process output, skimming text. */
+{
+    while (l){
+        size_t k = skim(n, s, l);
+        if (!k){ /* the parser takes it from here to the end of the line */
+            const char *e = memchr(s, '\n', l);
+            k = e? (size_t)(e - s) + 1 : l;
+            vtwrite(&n->vp, s, k);
+        }
+        s += k;
+        l -= k;
+    }
+}
+
+static bool
+background(const NODE *n) /* Does n's output wait its turn? */
+{
+    return n != focused || n->throttled;
+}
+
+static size_t
+allowance(const NODE *n) /* How much output n may process in a frame. */
+{
+    return n->throttled? THROTTLE_BYTES
+         : background(n)? BACKGROUND_BYTES : SIZE_MAX;
+}
+
+static bool
+spent(const NODE *n) /* Has n had its turn this frame? */
+{
+    return background(n) && (n->took >= allowance(n)
+                             || n->cpu >= BACKGROUND_TIME * 1000LL);
+}
+
+static void
+drain(NODE *n) /* Process a view's pending output. */
+{
+    const char *s = NULL;
+    size_t r = 0, m = ringused(n->rb); /* don't chase a busy input thread */
+    bool waiting = false, skimming = false, bg = background(n);
+    long long t = nsnow(), stop = t + BACKGROUND_TIME * 1000LL - n->cpu;
+    skimming = FAST_FORWARD && m > (size_t)FAST_FORWARD * n->h * n->w;
+    if (LOG_BACKPRESSURE && n->log) /* leave the rest until the log has room */
+        m = MIN(m, ringfree(n->log->q));
+    m = MIN(m, allowance(n) - MIN(n->took, allowance(n)));
+    traceevent(EV_PARSE, n->id, (long)m);
+    if (n->keyat && !n->echoat && m){
+        addlatency(&n->st.echo, t - n->keyat);
+        n->echoat = t;
+    }
+    while (m && (!bg || nsnow() < stop)
+           && (r = MIN(bg? MIN(m, SLICE) : m, ringpeek(n->rb, &s))) > 0){
+        if (skimming)
+            feed(n, s, r);
+        else
+            vtwrite(&n->vp, s, r);
+        if (observers)
+            observe(n, s, r);
+        if (n->log && ringput(n->log->q, s, r))
+            n->st.logged += r;
+        else if (n->log)
+            n->st.dropped += r;
+        waiting |= ringdrop(n->rb, r);
+        n->took += r;
+        m -= r;
+    }
+    if (IO_THREAD && waiting) /* let the input thread know there's room */
+        poke(pokefd[1]);
+    remember(n);
+    n->cpu += nsnow() - t;
+    n->st.parse += nsnow() - t;
+    traceevent(EV_PARSED, n->id, 0);
+}
+
+static void
+work(void) /* Drain busy views until there are none left; hold worklock. */
+{
+    while (nextbusy < nbusy){
+        NODE *n = busy[nextbusy++];
+        pthread_mutex_unlock(&worklock);
+        drain(n);
+        pthread_mutex_lock(&worklock);
+        if (++ndone == nbusy)
+            pthread_cond_signal(&donecond);
+    }
+}
+
+static void *
+worker(void *arg) /* Help drain busy views. Runs on its own thread. */
+{
+    unsigned long b = 0;
+    (void)arg;
+    pthread_mutex_lock(&worklock);
+    while (true){
+        while (b == batch)
+            pthread_cond_wait(&workcond, &worklock);
+        b = batch;
+        work();
+    }
+    return NULL;
+}
+
+static void
+findbusy(NODE *n, fd_set *f) /* Find all views with output to process. */
+{
+    for (int i = 0; n && i < n->nc; i++)
+        findbusy(n->c[i], f);
+    if (n && n->t == VIEW && n->pt > 0){
+        if (!IO_THREAD && FD_ISSET(n->pt, f))
+            fill(n);
+        if ((ringused(n->rb) && !spent(n)) || ringeof(n->rb)){
+            if (nbusy == maxbusy){
+                NODE **b = realloc(busy, sizeof(NODE *) * (maxbusy + 16));
+                if (!b)
+                    return;
+                busy = b;
+                maxbusy += 16;
+            }
+            busy[nbusy++] = n;
+            if (n == focused){ /* it goes first */
+                busy[nbusy - 1] = busy[0];
+                busy[0] = n;
+            }
+        }
+    }
+}
+
+static bool
+holdback(NODE *n, fd_set *f) /* Stop reading views that have had their turn. */
+{
+    bool held = false;
+    if (n && n->t == VIEW && n->pt >= 0 && ringused(n->rb) && spent(n)){
+        FD_CLR(n->pt, f);
+        return true;
+    }
+    for (int i = 0; n && i < n->nc; i++)
+        held |= holdback(n->c[i], f);
+    return held;
+}
+
+static void
+newframe(NODE *n) /* Give every view a fresh budget. */
+{
+    if (n && n->t == VIEW)
+        n->took = n->cpu = 0;
+    else if (n){
+        for (int i = 0; i < n->nc; i++)
+            newframe(n->c[i]);
+    }
+}
+
+static void
+wantwrite(NODE *n, fd_set *w) /* Note views with input waiting to go. */
+{
+    if (n && n->t == VIEW && n->pt >= 0 && ringused(n->wq))
+        FD_SET(n->pt, w);
+    else if (n){
+        for (int i = 0; i < n->nc; i++)
+            wantwrite(n->c[i], w);
+    }
+}
+
+static void
+sendinput(NODE *n) /* Write what we can of each view's input, nonblocking. */
+{
+    if (n && n->t == VIEW && n->pt >= 0){
+        for (int i = 0; i < 2 && ringused(n->wq); i++) /* it may wrap */
+            if (ringflush(n->wq, n->pt) < 0 && errno != EAGAIN
+             && errno != EINTR) /* nobody's listening */
+                ringdrop(n->wq, ringused(n->wq));
+    } else if (n){
+        for (int i = 0; i < n->nc; i++)
+            sendinput(n->c[i]);
+    }
+}
+
+static void
+getinput(fd_set *f) /* Check all ptty's for input. */
+{
+    pthread_mutex_lock(&worklock);
+    nbusy = nextbusy = ndone = 0;
+    for (DESK *d = desks; d; d = d->next)
+        findbusy(ROOT(d), f);
+    if (EMULATION_THREADS && nbusy > 1){
+        batch++;
+        pthread_cond_broadcast(&workcond);
+    }
+    work();
+    while (ndone < nbusy)
+        pthread_cond_wait(&donecond, &worklock);
+    pthread_mutex_unlock(&worklock);
+
+    /* Workers leave curses' global state alone; it's seen to here. */
+    bool bell = false;
+    mtm_define_pairs();
+    for (int i = 0; i < nbusy; i++){
+        bell |= busy[i]->bell;
+        busy[i]->bell = false;
+    }
+    for (int i = 0; i < nbusy; i++) if (ringeof(busy[i]->rb))
+        deletenode(busy[i]);
+    if (bell)
+        beep();
+}
+
+static void
+fitterm(void) /* Match the screen to the size of a newly attached terminal. */
+{
+    struct winsize ws = {0};
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col
+     && (ws.ws_row != LINES || ws.ws_col != COLS)){
+        traceevent(EV_RESIZE, 0, ws.ws_row << 16 | ws.ws_col);
+        resizeterm(ws.ws_row, ws.ws_col);
+        layout();
+    }
+}
+
+static void
+detach(void) /* Let go of the terminal, but keep running. */
+{
+    char c = SESSION_DETACH;
+    int null = -1;
+    if (lfd < 0 || detached || (null = open("/dev/null", O_RDWR)) < 0)
+        return;
+
+    hostpaste(false);
+    endwin();
+    for (int i = STDIN_FILENO; i <= STDERR_FILENO; i++)
+        dup2(null, i);
+    close(null);
+    if (cfd >= 0){
+        safewrite(cfd, &c, 1);
+        FD_CLR(cfd, &fds);
+        close(cfd);
+        cfd = -1;
+    }
+    FD_CLR(STDIN_FILENO, &fds);
+    detached = true;
+}
+
+static void
+attach(int s, int *tty) /* Take over the terminal of a newly connected client. */
+{
+    if (cfd >= 0) /* only one client at a time */
+        detach();
+    for (int i = STDIN_FILENO; i <= STDERR_FILENO; i++){
+        dup2(tty[i], i);
+        close(tty[i]);
+    }
+    if (detached) /* the terminal we started with already had this saved */
+        def_shell_mode();
+    cfd = s;
+    fcntl(cfd, F_SETFL, O_NONBLOCK);
+    fcntl(cfd, F_SETFD, FD_CLOEXEC);
+    FD_SET(cfd, &fds);
+    FD_SET(STDIN_FILENO, &fds);
+    nfds = MAX(nfds, cfd);
+    detached = false;
+    hostpaste(true);
+    fitterm();
+    redraw(root);
+}
+
+static void
+greet(void) /* Take a new connection to the session socket. */
+{
+    /* It's only heard once it speaks, so that a connection that never
+     * does can't hold everything else up. */
+    int s = accept(lfd, NULL, NULL);
+    GUEST *g = s >= 0? calloc(1, sizeof(GUEST)) : NULL;
+    if (!g){
+        if (s >= 0)
+            close(s);
+        return;
+    }
+
+    g->fd = s;
+    g->at = now();
+    fcntl(s, F_SETFL, O_NONBLOCK);
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+    FD_SET(s, &fds);
+    nfds = MAX(nfds, s);
+    g->next = guests;
+    guests = g;
+}
+
+static bool
+welcome(int s) /* Handle the first message on a connection. */
+{
+    char m[32] = {0};
+    int fd[3], nfd = 3, r = sessionrecv(s, m, sizeof(m), fd, &nfd);
+    if (r > 0 && m[0] == SESSION_ATTACH && nfd == 3){
+        attach(s, fd);
+        return true;
+    }
+    if (r > 0 && !nfd && (m[0] == SESSION_RAW || m[0] == SESSION_SCREEN)
+     && addobserver(s, m))
+        return true;
+
+    for (int i = 0; i < nfd; i++)
+        close(fd[i]);
+    return false;
+}
+
+static void
+hearguests(fd_set *r) /* Welcome guests that have spoken; drop slow ones. */
+{
+    for (GUEST **p = &guests, *g = *p; g; g = *p){
+        if (!FD_ISSET(g->fd, r) && g->at + GREET_TIMEOUT > now()){
+            p = &g->next;
+            continue;
+        }
+        *p = g->next;
+        FD_CLR(g->fd, &fds);
+        if (!FD_ISSET(g->fd, r) || !welcome(g->fd))
+            close(g->fd);
+        free(g);
+    }
+}
+
+static void
+hearclient(void) /* Handle a message from the attached client. */
+{
+    char c = 0;
+    ssize_t r = read(cfd, &c, 1);
+    if (r == 0 || (r < 0 && errno != EINTR && errno != EAGAIN))
+        detach(); /* the client has gone away */
+    else if (r > 0 && c == SESSION_RESIZE)
+        fitterm();
+}
+
+static void
+serve(void) /* Start a session server, then attach to it. */
+{
+    if ((lfd = sessionlisten(sockpath)) < 0)
+        quit(EXIT_FAILURE, errno == EEXIST? "session path is not a socket"
+                                          : "could not create session socket");
+    switch (fork()){
+        case -1:
+            quit(EXIT_FAILURE, "could not start session server");
+        case 0:
+            break;
+        default:
+            close(lfd);
+            lfd = sessionconnect(sockpath);
+            exit(lfd < 0? EXIT_FAILURE : sessionclient(lfd));
+    }
+    setsid();
+    FD_SET(lfd, &fds);
+    nfds = MAX(nfds, lfd);
+}
+
+static int
+bucket(unsigned long long us) /* Find the latency bucket for us. */
+{
+    int e = 4;
+    if (us < 16)
+        return (int)us;
+    while (e < 40 && us >> (e + 1))
+        e++;
+    return MIN(16 + (e - 4) * 8 + (int)(us >> (e - 3) & 7), NLATENCY - 1);
+}
+
+static unsigned long long
+bucketmax(int b) /* The largest latency, in us, that goes in bucket b. */
+{
+    int e = 4 + (b - 16) / 8;
+    if (b < 16)
+        return b;
+    return ((unsigned long long)(8 + (b - 16) % 8 + 1) << (e - 3)) - 1;
+}
+
+static void
+addlatency(LATENCY *h, long long ns) /* Count a latency. */
+{
+    h->n++;
+    h->max = MAX(h->max, (unsigned long long)ns);
+    h->b[bucket(ns / 1000)]++;
+}
+
+static void
+mergelatency(LATENCY *t, const LATENCY *h) /* Add h's latencies to t. */
+{
+    t->n += h->n;
+    t->max = MAX(t->max, h->max);
+    for (int i = 0; i < NLATENCY; i++)
+        t->b[i] += h->b[i];
+}
+
+static unsigned long long
+percentile(const LATENCY *h, int p) /* Find the p'th percentile, in us. */
+{
+    unsigned long long n = 0, want = (h->n * p + 99) / 100;
+    for (int i = 0; h->n && i < NLATENCY; i++)
+        if ((n += h->b[i]) >= want)
+            return MIN(bucketmax(i), h->max / 1000);
+    return 0;
+}
+
+static void
+shown(NODE *n, long long t) /* Count keys whose output is now on screen. */
+{
+    if (n && n->t == VIEW && n->echoat && !n->syncat){
+        addlatency(&n->st.shown, t - n->keyat);
+        n->keyat = n->echoat = 0;
+    } else if (n){
+        for (int i = 0; i < n->nc; i++)
+            shown(n->c[i], t);
+    }
+}
+
+static void
+addstats(STATS *t, const NODE *n) /* Add n's counters to t. */
+{
+    t->reads += __atomic_load_n(&n->st.reads, __ATOMIC_RELAXED);
+    t->bytes += __atomic_load_n(&n->st.bytes, __ATOMIC_RELAXED);
+    t->parse += n->st.parse;
+    t->scrolls += n->st.scrolls;
+    t->renders += n->st.renders;
+    t->logged += n->st.logged;
+    t->dropped += n->st.dropped;
+    t->skimmed += n->st.skimmed;
+    t->keys += n->st.keys;
+    for (int i = 0; i <= VTPARSER_PRINT; i++)
+        t->counts[i] += n->vp.counts[i];
+    mergelatency(&t->echo, &n->st.echo);
+    mergelatency(&t->shown, &n->st.shown);
+}
+
+static void
+putlatency(FILE *f, const char *l, const LATENCY *h) /* Write p50/p99/max. */
+{
+    fprintf(f, " %s_p50_us=%llu %s_p99_us=%llu %s_max_us=%llu", l,
+            percentile(h, 50), l, percentile(h, 99), l, h->max / 1000);
+}
+
+static void
+putstats(FILE *f, const char *l, const STATS *s) /* Write a line of stats. */
+{
+    fprintf(f, "%s reads=%llu bytes=%llu parse_us=%llu controls=%llu "
+               "escapes=%llu csis=%llu oscs=%llu prints=%llu scrolls=%llu "
+               "renders=%llu keys=%llu logged=%llu log_dropped=%llu "
+               "fast_forwarded=%llu", l,
+               s->reads, s->bytes, s->parse / 1000,
+               s->counts[VTPARSER_CONTROL], s->counts[VTPARSER_ESCAPE],
+               s->counts[VTPARSER_CSI], s->counts[VTPARSER_OSC],
+               s->counts[VTPARSER_PRINT], s->scrolls, s->renders, s->keys,
+               s->logged, s->dropped, s->skimmed);
+    putlatency(f, "echo", &s->echo);
+    putlatency(f, "screen", &s->shown);
+    fputc('\n', f);
+}
+
+static void
+viewstats(FILE *f, const NODE *n, STATS *t) /* Write stats for n's views. */
+{
+    if (n && n->t == VIEW){
+        char l[32] = {0};
+        STATS s = {0};
+        snprintf(l, sizeof(l) - 1, "view %d", n->id);
+        addstats(&s, n);
+        putstats(f, l, &s);
+        addstats(t, n);
+    } else if (n){
+        for (int i = 0; i < n->nc; i++)
+            viewstats(f, n->c[i], t);
+    }
+}
+
+static void
+putall(FILE *f) /* Write all the counters. */
+{
+    STATS t = totals;
+    fprintf(f, "mtm pid=%ld uptime_ms=%lld pairs=%d frames=%llu "
+               "frame_us=%llu host_bytes=%llu\n", (long)getpid(),
+               now() - started, mtm_pairs_used(), totals.frames,
+               totals.frame / 1000, totals.host);
+    for (DESK *d = desks; d; d = d->next)
+        viewstats(f, ROOT(d), &t);
+    putstats(f, "total", &t);
+}
+
+static void
+replace(const char *p, const char *x, void (*put)(FILE *)) /* Write p + x. */
+{
+    /* Write a new file and rename it, so readers never see half of one. */
+    char n[PATH_MAX] = {0}, tmp[PATH_MAX] = {0};
+    FILE *f = NULL;
+    snprintf(n, sizeof(n) - 1, "%s%s", p, x);
+    snprintf(tmp, sizeof(tmp) - 1, "%s%s.tmp", p, x);
+    if ((f = fopen(tmp, "w")) == NULL)
+        return;
+
+    put(f);
+    if (fclose(f) == 0)
+        rename(tmp, n);
+    else
+        unlink(tmp);
+}
+
+static void
+writestats(void) /* Write the stats file, and the trace next to it. */
+{
+    replace(statspath, "", putall);
+    if (TRACE_EVENTS)
+        replace(statspath, ".trace", writetrace);
+}
+
+static void
+askstats(int sig) /* Ask for the stats file to be written. */
+{
+    int e = errno;
+    (void)sig;
+    wantstats = 1;
+    poke(askfd[1]);
+    errno = e;
+}
+
+static void
+forget(NODE *n) /* Forget the text of n's scrollback; it has changed. */
+{
+    /* Numbering lines as if a whole scrollback's worth had gone by means
+     * no remembered line can match a line number that's still valid, and
+     * the whole scrollback is indexed again after the next batch. This can
+     * happen on a worker, so the search notices for itself in lost(). */
+    n->pushed += SCROLLBACK;
+}
+
+static void
+scrolled(NODE *n, int k) /* Note that n's screen is about to scroll k lines. */
+{
+    /* Scrolls of the same region add up, and can be followed on the host
+     * by a single scroll. */
+    SCRN *s = n->s;
+    int top = 0, bot = 0;
+    wgetscrreg(s->win, &top, &bot);
+    if (s == &n->pri && top == 0 && k > 0)
+        n->pushed += k;
+    else if (s == &n->pri && top == 0)
+        forget(n); /* lines came back out of the scrollback */
+
+    if (s->up && (top != s->st || bot != s->sb))
+        s->tangled = true;
+    if (!s->tangled){
+        s->st = top;
+        s->sb = bot;
+        s->up += k;
+        s->tangled = abs(s->up) > bot - top;
+    }
+}
+
+static char *
+rowtext(WINDOW *win, int row, int w, char *b) /* Put a row's text in b. */
+{
+    /* b has to have room for w * MB_LEN_MAX + 1 bytes. Reading cells moves
+     * the cursor, which has to be put back for the program's next output. */
+    mbstate_t ms;
+    size_t l = 0, k = 0;
+    int cy = 0, cx = 0;
+    char mb[MB_LEN_MAX + 1] = {0};
+    getyx(win, cy, cx);
+    memset(&ms, 0, sizeof(ms));
+    for (int x = 0; x < w; x++){
+        cchar_t c;
+        wchar_t wc[CCHARW_MAX + 1] = {0};
+        attr_t a = 0;
+        short p = 0;
+        mvwin_wch(win, row, x, &c);
+        getcchar(&c, wc, &a, &p, NULL);
+        if ((k = wcrtomb(mb, wc[0]? wc[0] : L' ', &ms)) != (size_t)-1){
+            memcpy(b + l, mb, k);
+            l += k;
+        }
+        x += MAX(charwidth(wc[0]), 1) - 1;
+    }
+    while (l && b[l - 1] == ' ')
+        l--;
+    b[l] = 0;
+    wmove(win, cy, cx);
+    return b;
+}
+
+static char *
+linetext(WINDOW *win, int row, int w) /* Get the text in a row of win. */
+{
+    static char *b;
+    static size_t nb;
+    if (nb < (size_t)w * MB_LEN_MAX + 1){
+        char *t = realloc(b, (size_t)w * MB_LEN_MAX + 1);
+        if (!t)
+            return NULL;
+        b = t;
+        nb = (size_t)w * MB_LEN_MAX + 1;
+    }
+    return rowtext(win, row, w, b);
+}
+
+static void
+remember(NODE *n) /* Index the lines that have gone into n's scrollback. */
+{
+    /* This runs after each batch of output, maybe on a worker, so lines are
+     * taken from the pad once, as they scroll off, and a search only has to
+     * look at the index. */
+    SCRN *s = &n->pri;
+    long long l = MAX(n->kept, n->pushed - s->tos);
+    char *b = NULL;
+    if (!n->ix || l >= n->pushed
+     || !(b = malloc((size_t)n->w * MB_LEN_MAX + 1)))
+        return;
+    for (; l < n->pushed; l++){
+        TEXT *t = n->ix + l % SCROLLBACK;
+        free(t->s);
+        t->s = strdup(rowtext(s->win, (int)(l - n->pushed + s->tos), n->w, b));
+        t->line = l;
+    }
+    n->kept = n->pushed;
+    free(b);
+}
+
+static const char *
+findline(NODE *n, long long l) /* Get the text of line l, if it's still there. */
+{
+    /* The screen changes all the time, but lines in the scrollback don't,
+     * so their text is kept in the index; it's only taken from the pad here
+     * if the index hasn't caught up with the scrollback yet. */
+    SCRN *s = n->s;
+    long long row = l - n->pushed + s->tos;
+    TEXT *t = n->ix? n->ix + l % SCROLLBACK : NULL;
+    if (row < 0 || row >= s->tos + n->h)
+        return NULL;
+    if (row >= s->tos || !t)
+        return linetext(s->win, (int)row, n->w);
+    if (!t->s || t->line != l){
+        const char *b = linetext(s->win, (int)row, n->w);
+        free(t->s);
+        t->s = b? strdup(b) : NULL;
+        t->line = l;
+    }
+    return t->s;
+}
+
+static bool
+matchat(const char *t, int from, int *at, int *len) /* Match at or after from. */
+{
+    regmatch_t m = {0};
+    if (from > (int)strlen(t)
+     || regexec(&re, t + from, 1, &m, from? REG_NOTBOL : 0) != 0)
+        return false;
+    *at = from + (int)m.rm_so;
+    *len = (int)(m.rm_eo - m.rm_so);
+    return true;
+}
+
+static bool
+matchline(const char *t, int from, int dir, int *at, int *len)
+{
+    /* Find the first match in t after from, or the last one before it. */
+    int a = 0, l = 0;
+    bool ok = false;
+    if (dir > 0)
+        return matchat(t, from + 1, at, len);
+    for (int i = 0; matchat(t, i, &a, &l) && a < from; i = a + MAX(l, 1)){
+        *at = a;
+        *len = l;
+        ok = true;
+    }
+    return ok;
+}
+
+static bool
+find(NODE *n, long long l, int from, int dir) /* Find the next match. */
+{
+    long long first = n->pushed - n->s->tos, last = n->pushed + n->h - 1;
+    for (l = MIN(MAX(l, first), last); compiled && l >= first && l <= last;
+         l += dir, from = dir < 0? INT_MAX : -1){
+        const char *t = findline(n, l);
+        if (t && matchline(t, from, dir, &hitat, &hitlen)){
+            long long row = l - n->pushed + n->s->tos;
+            if (row < n->s->off || row > n->s->off + n->h - 2)
+                n->s->off = (int)MIN(MAX(row - n->h / 2, 0), n->s->tos);
+            hitline = l;
+            return found = true;
+        }
+    }
+    return false;
+}
+
+static void
+lost(NODE *n) /* Let go of the match if its line has gone. */
+{
+    /* A forgotten line is numbered as if it had scrolled off the top. */
+    if (found && hitline < n->pushed - n->s->tos)
+        found = stuck = false;
+}
+
+static void
+compile(NODE *n) /* Compile the query, and search again from the start. */
+{
+    char q[MAXQUERY * (MB_LEN_MAX + 1) + 1] = {0}, mb[MB_LEN_MAX + 1];
+    int flags = REG_EXTENDED | REG_ICASE;
+    size_t l = 0;
+    mbstate_t ms;
+
+    /* Plain text is searched for as a regular expression that matches it,
+     * and case only matters if the query has some capitals in it. */
+    memset(&ms, 0, sizeof(ms));
+    for (int i = 0; i < nquery; i++){
+        size_t k = wcrtomb(mb, query[i], &ms);
+        if (!regexsearch && query[i] < 0x80 && strchr("\\.[]()*+?{}|^$", query[i]))
+            q[l++] = '\\';
+        if (k != (size_t)-1)
+            memcpy(q + l, mb, k), l += k;
+        if (iswupper(query[i]))
+            flags &= ~REG_ICASE;
+    }
+
+    if (compiled)
+        regfree(&re);
+    compiled = nquery && regcomp(&re, q, flags) == 0;
+    found = stuck = false;
+    n->s->off = oldoff;
+    if (compiled)
+        find(n, n->pushed - n->s->tos + oldoff + n->h - 1, INT_MAX, -1);
+    n->dirty = true;
+}
+
+static void
+startsearch(NODE *n, bool regex) /* Start searching in n. */
+{
+    searching = n;
+    regexsearch = regex;
+    nquery = 0;
+    oldoff = n->s->off;
+    compile(n);
+}
+
+static void
+endsearch(NODE *n, bool keep) /* Stop searching, maybe staying where we are. */
+{
+    if (!keep)
+        n->s->off = oldoff;
+    if (compiled)
+        regfree(&re);
+    compiled = found = false;
+    searching = NULL;
+    touchwin(n->s->win); /* cover up the highlights */
+    n->dirty = true;
+}
+
+static bool
+editquery(bool code, wint_t k) /* Edit the query; true if it changed. */
+{
+    if ((code && k == KEY_BACKSPACE) || (!code && (k == 0x7f || k == 8)))
+        nquery = MAX(nquery - 1, 0);
+    else if (!code && k == CTL('u'))
+        nquery = 0;
+    else if (!code && iswprint(k) && nquery < MAXQUERY)
+        query[nquery++] = k;
+    else
+        return false;
+    return true;
+}
+
+static void
+searchkey(int r, wint_t k) /* Handle a key typed while searching. */
+{
+    NODE *n = searching;
+    bool code = r == KEY_CODE_YES;
+    lost(n);
+    if ((code && k == KEY_UP) || (!code && k == CTL('r')))
+        stuck = found && !find(n, hitline, hitat, -1);
+    else if ((code && k == KEY_DOWN) || (!code && k == CTL('s')))
+        stuck = found && !find(n, hitline, hitat, 1);
+    else if ((code && k == KEY_ENTER) || (!code && (k == L'\r' || k == L'\n')))
+        endsearch(n, true);
+    else if (!code && k == L'\033')
+        endsearch(n, false);
+    else if (code && k == KEY_RESIZE){
+        endsearch(n, false);
+        resized();
+    } else if (editquery(code, k))
+        compile(n);
+    n->dirty = true;
+}
+
+static void
+highlight(NODE *n, int y, const char *t, int at, int len, attr_t on)
+{
+    /* Draw the cells of a match in row y of n's view again, with a twist,
+     * in a window of their own laid over the view. */
+    int x = 0, w = 0;
+    mbstate_t ms;
+    memset(&ms, 0, sizeof(ms));
+    for (int i = 0; i < at + len; ){
+        wchar_t c = 0;
+        size_t k = mbrtowc(&c, t + i, at + len - i, &ms);
+        if (k == 0 || k == (size_t)-1 || k == (size_t)-2)
+            break;
+        if (i < at)
+            x += MAX(charwidth(c), 1);
+        else
+            w += MAX(charwidth(c), 1);
+        i += (int)k;
+    }
+    w = MIN(MAX(w, 1), n->w - x);
+    WINDOW *h = w > 0? newwin(1, w, n->y + y, n->x + x) : NULL;
+    if (!h)
+        return;
+
+    for (int i = 0; i < w; i++){
+        cchar_t c;
+        wchar_t wc[CCHARW_MAX + 1] = {0};
+        attr_t a = 0;
+        short p = 0;
+        mvwin_wch(n->s->win, n->s->off + y, x + i, &c);
+        getcchar(&c, wc, &a, &p, NULL);
+        setcchar(&c, wc[0]? wc : L" ", on == A_REVERSE? a ^ on : a | on, p, NULL);
+        mvwadd_wchnstr(h, 0, i, &c, 1);
+        i += MAX(charwidth(wc[0]), 1) - 1;
+    }
+    wnoutrefresh(h);
+    delwin(h);
+}
+
+static void
+drawprompt(NODE *n, const char *p, const char *m) /* Show a prompt over n. */
+{
+    /* The prompt covers the bottom row of the view, with the cursor after
+     * the query and a message after that. */
+    int y = 0, x = 0;
+    WINDOW *w = newwin(1, n->w, n->y + n->h - 1, n->x);
+    if (!w)
+        return;
+
+    touchwin(n->s->win); /* to be covered up again later */
+    wbkgdset(w, COLOR_PAIR(0) | A_REVERSE | ' ');
+    werase(w);
+    mvwaddstr(w, 0, 0, p);
+    waddnwstr(w, query, nquery);
+    getyx(w, y, x);
+    waddstr(w, m);
+    wmove(w, y, x);
+    wnoutrefresh(w);
+    delwin(w);
+}
+
+static void
+drawsearch(NODE *n) /* Show matches and the search prompt over n. */
+{
+    touchwin(n->s->win); /* the highlights have to be put back every time */
+    lost(n);
+    for (int y = 0; compiled && y < n->h - 1; y++){
+        long long l = n->pushed - n->s->tos + n->s->off + y;
+        const char *t = findline(n, l);
+        int at = 0, len = 0;
+        for (int i = 0; t && matchat(t, i, &at, &len); i = at + MAX(len, 1))
+            highlight(n, y, t, at, len, found && l == hitline && at == hitat?
+                                        A_REVERSE : A_UNDERLINE);
+    }
+    drawprompt(n, regexsearch? "regex search: " : "search: ",
+               !nquery? "" : !compiled? "  [bad expression]"
+               : !found? "  [not found]" : stuck? "  [no more]" : "");
+}
+
+static void
+dropexports(NODE *n) /* Stop exporting n, which is going away. */
+{
+    for (EXPORT *e = exports; e; e = e->next) if (e->n == n)
+        e->n = NULL;
+}
+
+static void *
+copier(void *a) /* Copy a pipe to a file; runs on its own thread. */
+{
+    char b[BUFSIZ];
+    int *fd = a, in = fd[0], out = fd[1];
+    ssize_t r = 0;
+    free(fd);
+    while ((r = read(in, b, sizeof(b))) != 0){
+        if (r < 0 && errno == EINTR)
+            continue;
+        else if (r < 0)
+            break;
+        safewrite(out, b, (size_t)r);
+    }
+    close(out);
+    close(in);
+    return NULL;
+}
+
+static int
+exportfd(const char *d) /* Open a file, or a pipe to a command, to export to. */
+{
+    /* Writes to a file can't be kept from blocking, so files are written
+     * on a thread of their own, and we get a pipe to it, like a command. */
+    char path[PATH_MAX] = {0};
+    int p[2] = {-1, -1}, *fd = NULL;
+    if (d[0] != '|'){
+        const char *home = getenv("HOME");
+        snprintf(path, sizeof(path) - 1, "%s%s",
+                 d[0] == '~' && d[1] == '/' && home? home : "",
+                 d[0] == '~' && d[1] == '/' && home? d + 1 : d);
+        if (!(fd = malloc(2 * sizeof(int))))
+            return -1;
+        if ((fd[1] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0
+         || pipe(p) != 0){
+            if (fd[1] >= 0)
+                close(fd[1]);
+            free(fd);
+            return -1;
+        }
+        fd[0] = p[0];
+        fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+        if (!spawn(copier, fd)){
+            close(fd[0]);
+            close(fd[1]);
+            close(p[1]);
+            free(fd);
+            return -1;
+        }
+        return p[1];
+    }
+
+    if (pipe(p) != 0)
+        return -1;
+    switch (fork()){
+        case -1:
+            close(p[0]);
+            close(p[1]);
+            return -1;
+        case 0: /* the command mustn't scribble on our screen */
+            dup2(p[0], STDIN_FILENO);
+            dup2(open("/dev/null", O_RDWR), STDOUT_FILENO);
+            dup2(STDOUT_FILENO, STDERR_FILENO);
+            for (int i = STDERR_FILENO + 1; i < FD_SETSIZE; i++)
+                close(i);
+            signal(SIGCHLD, SIG_DFL);
+            signal(SIGPIPE, SIG_DFL);
+            execl("/bin/sh", "sh", "-c", d + 1, NULL);
+            _exit(EXIT_FAILURE);
+    }
+    close(p[0]);
+    return p[1];
+}
+
+static int
+queryfd(void) /* Open where the query says to write to, nonblocking. */
+{
+    char d[MAXQUERY * MB_LEN_MAX + 1] = {0};
+    int fd = -1;
+    query[nquery] = 0;
+    if (wcstombs(d, query, sizeof(d) - 1) == (size_t)-1 || !d[0]
+     || (fd = exportfd(d)) < 0)
+        return -1;
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    nfds = MAX(nfds, fd);
+    return fd;
+}
+
+static void
+exportview(NODE *n, bool sgr) /* Start exporting n to where the query says. */
+{
+    EXPORT *e = calloc(1, sizeof(EXPORT));
+    if (!e || (e->fd = queryfd()) < 0){
+        free(e);
+        beep();
+        return;
+    }
+
+    e->n = n;
+    e->s = n->s;
+    e->sgr = sgr;
+    e->line = n->pushed - n->s->tos;
+    e->last = n->pushed + n->h - 1;
+    e->blanks = -1; /* nothing written yet, so blank lines are dropped */
+    e->next = exports;
+    exports = e;
+}
+
+static bool
+exportchunk(EXPORT *e) /* Render the next few lines of an export. */
+{
+    /* Blank lines are held back until something follows them, so that
+     * there are none at either end. */
+    FILE *f = NULL;
+    attr_t la = 0;
+    short lp = 0;
+    mbstate_t ms;
+    free(e->b);
+    e->b = NULL;
+    e->l = e->done = 0;
+    if (!e->n || e->line > e->last || !(f = open_memstream(&e->b, &e->l)))
+        return false;
+
+    memset(&ms, 0, sizeof(ms));
+    for (int i = 0; i < EXPORTCHUNK && e->line <= e->last; i++, e->line++){
+        NODE *n = e->n;
+        long long row = e->line - n->pushed + e->s->tos;
+        const char *t = row >= 0 && row < e->s->tos + n->h?
+                        linetext(e->s->win, (int)row, n->w) : NULL;
+        if (!t || !t[0]){ /* blank, gone, or renumbered */
+            e->blanks += e->blanks >= 0 && t;
+            continue;
+        }
+        for (; e->blanks > 0; e->blanks--)
+            fputc('\n', f);
+        e->blanks = 0;
+        if (!e->sgr)
+            fputs(t, f);
+        else if (putrow(f, e->s->win, (int)row, n->w, true, &la, &lp, &ms)
+              && (la || lp)){
+            fputs("\033[0m", f);
+            la = lp = 0;
+        }
+        fputc('\n', f);
+    }
+    return fclose(f) == 0;
+}
+
+static void
+feedexports(void) /* Write what we can of each export, without waiting. */
+{
+    for (EXPORT **p = &exports, *e = *p; e; e = *p){
+        bool ok = e->done < e->l || exportchunk(e);
+        if (ok && e->done < e->l){
+            ssize_t w = write(e->fd, e->b + e->done, e->l - e->done);
+            ok = w >= 0 || errno == EAGAIN || errno == EINTR;
+            e->done += w > 0? (size_t)w : 0;
+        }
+
+        if (!ok){
+            *p = e->next;
+            close(e->fd);
+            free(e->b);
+            free(e);
+        } else
+            p = &e->next;
+    }
+}
+
+static void
+startlog(NODE *n) /* Start copying n's output to where the query says. */
+{
+    LOG *g = calloc(1, sizeof(LOG));
+    if (!g || !(g->q = newring(LOG_BUFFER)) || (g->fd = queryfd()) < 0){
+        if (g)
+            free(g->q);
+        free(g);
+        beep();
+        return;
+    }
+
+    g->n = n;
+    g->next = logs;
+    logs = n->log = g;
+}
+
+static void
+stoplog(NODE *n) /* Stop logging n; what's queued is still written. */
+{
+    if (n->log)
+        n->log->n = NULL;
+    n->log = NULL;
+}
+
+static void
+feedlogs(void) /* Write what we can of each log, without waiting. */
+{
+    for (LOG **p = &logs, *g = *p; g; g = *p){
+        bool ok = true;
+        for (int i = 0; ok && i < 2 && ringused(g->q); i++) /* it may wrap */
+            ok = ringflush(g->q, g->fd) >= 0 || errno == EAGAIN
+              || errno == EINTR;
+
+        if (!ok || (!g->n && !ringused(g->q))){
+            if (g->n)
+                g->n->log = NULL;
+            *p = g->next;
+            close(g->fd);
+            free(g->q);
+            free(g);
+        } else
+            p = &g->next;
+    }
+}
+
+static void
+startnaming(NODE *n, Naming what) /* Ask where to export or log n. */
+{
+    naming = n;
+    namingfor = what;
+    nquery = 0;
+    n->dirty = true;
+}
+
+static void
+namekey(int r, wint_t k) /* Handle a key typed while naming an export. */
+{
+    NODE *n = naming;
+    bool code = r == KEY_CODE_YES;
+    if ((code && k == KEY_ENTER) || (!code && (k == L'\r' || k == L'\n'))){
+        naming = NULL;
+        if (namingfor == NAME_LOG)
+            startlog(n);
+        else
+            exportview(n, namingfor == NAME_SGR);
+    } else if (!code && k == L'\033')
+        naming = NULL;
+    else if (code && k == KEY_RESIZE){
+        naming = NULL;
+        resized();
+    } else
+        editquery(code, k);
+    touchwin(n->s->win); /* cover up the prompt */
+    n->dirty = true;
+}
+
+static void
+scrollback(NODE *n)
+{
+    n->s->off = MAX(0, n->s->off - n->h / 2);
+    n->dirty = true;
+}
+
+static void
+scrollforward(NODE *n)
+{
+    n->s->off = MIN(n->s->tos, n->s->off + n->h / 2);
+    n->dirty = true;
+}
+
+static void
+scrollbottom(NODE *n)
+{
+    n->s->off = n->s->tos;
+    n->dirty = true;
+}
+
+static bool
+typed(NODE *n) /* Note that a key is going to n; false if it won't fit. */
+{
+    /* A program that isn't reading its input mustn't hold up the keyboard,
+     * or the command key could never get through to rescue it; typed keys
+     * that don't fit are dropped, with a bell, leaving room for answers.
+     * Pasted text is never dropped: the keyboard waits for room instead. */
+    static bool dropping = false;
+    scrollbottom(n);
+    if (ringfree(n->wq) < KEYROOM){
+        if (!dropping)
+            beep();
+        return dropping = true, false;
+    }
+    dropping = false;
+    n->st.keys++;
+    if (!n->keyat)
+        n->keyat = nsnow();
+    return true;
+}
+
+static void
+resized(void) /* Fit the screen to a resized host terminal. */
+{
+    traceevent(EV_RESIZE, 0, LINES << 16 | COLS);
+    layout();
+    scrollbottom(focused);
+}
+
+static void
+sendarrow(NODE *n, const char *k)
+{
+    char buf[100] = {0};
+    snprintf(buf, sizeof(buf) - 1, "\033%s%s", n->pnm? "O" : "[", k);
+    SEND(n, buf);
+}
+
+static void
+sendchar(NODE *n, wint_t k) /* Send a typed character to n. */
+{
+    char c[MB_LEN_MAX + 1] = {0};
+    int l = wctomb(c, k);
+    if (l > 0 && typed(n))
+        SENDN(n, c, l);
+}
+
+static BINDING *
+binding(Keymap m, bool code, int k) /* Find where k's binding goes, if it can. */
+{
+    if (code? k < KEY_MIN || k >= NKEYS : k < 0 || k >= KEY_MIN)
+        return NULL;
+    return &keymap[m][k];
+}
+
+static bool
+bindkey(Keymap m, int r, int k, Action a, const char *s, size_t l)
+{
+    BINDING *b = binding(m, r == KEY_CODE_YES, k);
+    char *c = calloc(1, l + 1); /* arrows are used as strings */
+    if (!b || !c)
+        return free(c), false;
+
+    memcpy(c, s? s : "", l);
+    free(b->s);
+    b->a = a;
+    b->s = c;
+    b->l = l;
+    return true;
+}
+
+static void
+bindkeys(void) /* Bind the keys in config.h. */
+{
+    const char c = commandkey;
+    #define KEY(i)  OK, (i)
+    #define CODE(i) KEY_CODE_YES, (i)
+    #define BIND(m, k, a) bindkey(m, k, a, NULL, 0)
+    #define SENDS(k, s) bindkey(BIND_KEY, k, DO_SEND, s, sizeof(s) - 1)
+
+    bindkey(BIND_KEY, KEY(0),   DO_SEND, "", 1);
+    SENDS(KEY(L'\n'),           "\n");
+    BIND(BIND_KEY, KEY(L'\r'),  DO_RETURN);
+    BIND(BIND_KEY, CODE(KEY_ENTER), DO_RETURN);
+    bindkey(BIND_KEY, CODE(KEY_UP),    DO_ARROW, "A", 1);
+    bindkey(BIND_KEY, CODE(KEY_DOWN),  DO_ARROW, "B", 1);
+    bindkey(BIND_KEY, CODE(KEY_RIGHT), DO_ARROW, "C", 1);
+    bindkey(BIND_KEY, CODE(KEY_LEFT),  DO_ARROW, "D", 1);
+    SENDS(CODE(KEY_HOME),       "\033[1~");
+    SENDS(CODE(KEY_END),        "\033[4~");
+    SENDS(CODE(KEY_PPAGE),      "\033[5~");
+    SENDS(CODE(KEY_NPAGE),      "\033[6~");
+    SENDS(CODE(KEY_BACKSPACE),  "\177");
+    SENDS(CODE(KEY_DC),         "\033[3~");
+    SENDS(CODE(KEY_IC),         "\033[2~");
+    SENDS(CODE(KEY_BTAB),       "\033[Z");
+    SENDS(CODE(KEY_F(1)),       "\033OP");
+    SENDS(CODE(KEY_F(2)),       "\033OQ");
+    SENDS(CODE(KEY_F(3)),       "\033OR");
+    SENDS(CODE(KEY_F(4)),       "\033OS");
+    SENDS(CODE(KEY_F(5)),       "\033[15~");
+    SENDS(CODE(KEY_F(6)),       "\033[17~");
+    SENDS(CODE(KEY_F(7)),       "\033[18~");
+    SENDS(CODE(KEY_F(8)),       "\033[19~");
+    SENDS(CODE(KEY_F(9)),       "\033[20~");
+    SENDS(CODE(KEY_F(10)),      "\033[21~");
+    SENDS(CODE(KEY_F(11)),      "\033[23~");
+    SENDS(CODE(KEY_F(12)),      "\033[24~");
+    BIND(BIND_KEY, CODE(KEY_RESIZE),      DO_RESIZE);
+    BIND(BIND_KEY, KEY(commandkey),       DO_COMMAND);
+    BIND(BIND_SCROLLED, SCROLLUP,         DO_SCROLLUP);
+    BIND(BIND_SCROLLED, SCROLLDOWN,       DO_SCROLLDOWN);
+    BIND(BIND_SCROLLED, RECENTER,         DO_RECENTER);
+    BIND(BIND_COMMAND, CODE(KEY_RESIZE),  DO_RESIZE);
+    BIND(BIND_COMMAND, MOVE_UP,           DO_MOVE_UP);
+    BIND(BIND_COMMAND, MOVE_DOWN,         DO_MOVE_DOWN);
+    BIND(BIND_COMMAND, MOVE_LEFT,         DO_MOVE_LEFT);
+    BIND(BIND_COMMAND, MOVE_RIGHT,        DO_MOVE_RIGHT);
+    BIND(BIND_COMMAND, MOVE_OTHER,        DO_MOVE_OTHER);
+    BIND(BIND_COMMAND, HSPLIT,            DO_HSPLIT);
+    BIND(BIND_COMMAND, VSPLIT,            DO_VSPLIT);
+    BIND(BIND_COMMAND, DELETE_NODE,       DO_DELETE);
+    BIND(BIND_COMMAND, BAILOUT,           DO_BAILOUT);
+    BIND(BIND_COMMAND, NUKE,              DO_NUKE);
+    BIND(BIND_COMMAND, REDRAW,            DO_REDRAW);
+    BIND(BIND_COMMAND, DETACH,            DO_DETACH);
+    BIND(BIND_COMMAND, SEARCH,            DO_SEARCH);
+    BIND(BIND_COMMAND, SEARCH_REGEX,      DO_SEARCH_REGEX);
+    BIND(BIND_COMMAND, EXPORT_TEXT,       DO_EXPORT_TEXT);
+    BIND(BIND_COMMAND, EXPORT_SGR,        DO_EXPORT_SGR);
+    BIND(BIND_COMMAND, LOG_OUTPUT,        DO_LOG);
+    BIND(BIND_COMMAND, SCROLLUP,          DO_SCROLLUP);
+    BIND(BIND_COMMAND, SCROLLDOWN,        DO_SCROLLDOWN);
+    BIND(BIND_COMMAND, RECENTER,          DO_RECENTER);
+    BIND(BIND_COMMAND, NEW_WINDOW,        DO_NEW_WINDOW);
+    BIND(BIND_COMMAND, NEXT_WINDOW,       DO_NEXT_WINDOW);
+    BIND(BIND_COMMAND, PREV_WINDOW,       DO_PREV_WINDOW);
+    BIND(BIND_COMMAND, ZOOM,              DO_ZOOM);
+    BIND(BIND_COMMAND, THROTTLE,          DO_THROTTLE);
+    BIND(BIND_COMMAND, BALANCE,           DO_BALANCE);
+    bindkey(BIND_COMMAND, KEY(commandkey), DO_SEND, &c, 1);
+}
+
+static bool
+word(const char **p, char *w, size_t *l) /* Read a word of a key map line. */
+{
+    /* Words are separated by blanks, unless quoted, and "#" starts a
+     * comment. Quoted words can have C-style escapes, and \e for escape.
+     */
+    const char *s = *p + strspn(*p, " \t\r\n");
+    char *e = NULL;
+    bool q = *s == '"';
+    *l = 0;
+    if (!*s || *s == '#')
+        return *p = s, false;
+
+    for (s += q; *s && (q? *s != '"' : !strchr(" \t\r\n", *s)); s++){
+        int c = *s;
+        if (q && c == '\\') switch (*++s){
+            case 'e': c = '\033';                                   break;
+            case 'n': c = '\n';                                     break;
+            case 'r': c = '\r';                                     break;
+            case 't': c = '\t';                                     break;
+            case 'x': c = (int)strtol(s + 1, &e, 16); s = e - 1;    break;
+            case '0': case '1': case '2': case '3':
+                c = (int)strtol(s, &e, 8); s = e - 1;               break;
+            case 0:   return false;
+            default:  c = *s;                                       break;
+        }
+        if (*l == MAXWORD)
+            return false;
+        w[(*l)++] = (char)c;
+    }
+    if (q && *s++ != '"')
+        return false;
+    *p = s;
+    return *l || q;
+}
+
+static int
+keycode(const char *w, size_t l, int *r) /* Find the key a word names. */
+{
+    wchar_t c = 0;
+    *r = OK;
+    if (l == 2 && w[0] == '^')
+        return w[1] == '?'? 0x7f : CTL(w[1]);
+    if (mbtowc(&c, w, l) == (int)l && c < KEY_MIN)
+        return c;
+    *r = KEY_CODE_YES;
+    for (int k = KEY_MIN; k <= KEY_MAX; k++)
+        if (keyname(k) && strlen(keyname(k)) == l && !memcmp(keyname(k), w, l))
+            return k;
+    return -1;
+}
+
+static void
+loadkeys(const char *path) /* Apply a key map file, or quit trying. */
+{
+    /* Each line says which key map, which key, what it does, and for
+     * sending, what to send:
+     *
+     *     command  h          vsplit
+     *     key      KEY_F(12)  send "\e[24~"
+     */
+    char l[1024] = {0}, m[MAXWORD], k[MAXWORD], a[MAXWORD], s[MAXWORD];
+    char x[MAXWORD], e[PATH_MAX + 100] = {0};
+    FILE *f = fopen(path, "r");
+    if (!f){
+        snprintf(e, sizeof(e) - 1, "%s: %s", path, strerror(errno));
+        quit(EXIT_FAILURE, e);
+    }
+    for (int no = 1; fgets(l, sizeof(l), f); no++){
+        const char *p = l, *err = NULL;
+        size_t ml = 0, kl = 0, al = 0, sl = 0, xl = 0;
+        int i = 0, j = 0, r = OK, c = -1;
+        if (!word(&p, m, &ml))
+            err = *p && *p != '#'? "bad word" : NULL;
+        else if (!word(&p, k, &kl) || !word(&p, a, &al))
+            err = "expected a key map, a key, and an action";
+        else{
+            bool arg = word(&p, s, &sl), more = arg && word(&p, x, &xl);
+            while (i < NBINDS && (strlen(keymaps[i]) != ml
+                                  || memcmp(keymaps[i], m, ml)))
+                i++;
+            while (j < NACTIONS && (strlen(actions[j]) != al
+                                    || memcmp(actions[j], a, al)))
+                j++;
+            c = keycode(k, kl, &r);
+            if (i == NBINDS)
+                err = "no such key map";
+            else if (j == NACTIONS)
+                err = "no such action";
+            else if (more || arg != (j == DO_SEND || j == DO_ARROW))
+                err = arg? "too many words" : "nothing to send";
+            else if (!bindkey(i, r, c, j, s, sl))
+                err = "that key can't be bound";
+        }
+        if (err){
+            snprintf(e, sizeof(e) - 1, "%s:%d: %s", path, no, err);
+            quit(EXIT_FAILURE, e);
+        }
+    }
+    fclose(f);
+}
+
+static void
+showdesk(DESK *d) /* Show window d. */
+{
+    if (d && d != desk){
+        usedesk(d);
+        layout(); /* the screen may have changed size meanwhile */
+        redraw(root);
+    }
+}
+
+static DESK *
+prevdesk(void) /* Find the window before the current one. */
+{
+    DESK *d = desks;
+    while (d->next && d->next != desk)
+        d = d->next;
+    return d;
+}
+
+static void
+newdesk(void) /* Open a new window. */
+{
+    DESK *d = calloc(1, sizeof(DESK));
+    NODE *v = d? newview(NULL, 0, 0, LINES, COLS) : NULL;
+    if (!v){
+        free(d);
+        return;
+    }
+
+    d->root = d->focused = v;
+    d->next = desk->next;
+    desk->next = d;
+    showdesk(d);
+}
+
+static void
+act(NODE *n, const BINDING *b) /* Do what a key is bound to. */
+{
+    switch (b->a){
+        case DO_NOTHING:      case DO_COMMAND:     case DO_BAILOUT:   break;
+        case DO_SEND:         if (typed(n)) SENDN(n, b->s, b->l);     break;
+        case DO_RETURN:       if (typed(n))
+                                  SEND(n, n->lnm? "\r\n" : "\r");
+                              break;
+        case DO_ARROW:        if (typed(n)) sendarrow(n, b->s);       break;
+        case DO_RESIZE:       resized();                              break;
+        case DO_MOVE_UP:      unzoom(); focus(findnode(root, ABOVE(n))); break;
+        case DO_MOVE_DOWN:    unzoom(); focus(findnode(root, BELOW(n))); break;
+        case DO_MOVE_LEFT:    unzoom(); focus(findnode(root, LEFT(n)));  break;
+        case DO_MOVE_RIGHT:   unzoom(); focus(findnode(root, RIGHT(n))); break;
+        case DO_MOVE_OTHER:   unzoom(); focus(lastfocused);           break;
+        case DO_HSPLIT:       unzoom(); split(n, HORIZONTAL);         break;
+        case DO_VSPLIT:       unzoom(); split(n, VERTICAL);           break;
+        case DO_DELETE:       deletenode(n);                          break;
+        case DO_NUKE:         wclear(n->s->win); forget(n);           break;
+        case DO_REDRAW:       redraw(root);                           break;
+        case DO_DETACH:       detach();                               break;
+        case DO_SEARCH:       startsearch(n, false);                  break;
+        case DO_SEARCH_REGEX: startsearch(n, true);                   break;
+        case DO_EXPORT_TEXT:  startnaming(n, NAME_TEXT);              break;
+        case DO_EXPORT_SGR:   startnaming(n, NAME_SGR);               break;
+        case DO_LOG:          n->log? stoplog(n)
+                                    : startnaming(n, NAME_LOG);       break;
+        case DO_SCROLLUP:     scrollback(n);                          break;
+        case DO_SCROLLDOWN:   scrollforward(n);                       break;
+        case DO_RECENTER:     scrollbottom(n);                        break;
+        case DO_NEW_WINDOW:   newdesk();                              break;
+        case DO_NEXT_WINDOW:  showdesk(desk->next? desk->next : desks); break;
+        case DO_PREV_WINDOW:  showdesk(prevdesk());                   break;
+        case DO_ZOOM:         if (zoomed)
+                                  unzoom();
+                              else if (root != n)
+                                  zoomed = n, layout();
+                              break;
+        case DO_THROTTLE:     n->throttled = !n->throttled;           break;
+        case DO_BALANCE:      unzoom(); balance(root); layout();      break;
+        case NACTIONS:                                                break;
+    }
+}
+
+static bool
+handlechar(int r, int k) /* Handle a single input character. */
 {
-    const char cmdstr[] = {commandkey, 0};
     static bool cmd = false;
     NODE *n = focused;
-    #define KERR(i) (r == ERR && (i) == k)
-    #define KEY(i)  (r == OK  && (i) == k)
-    #define CODE(i) (r == KEY_CODE_YES && (i) == k)
-    #define INSCR (n->s->tos != n->s->off)
-    #define SB scrollbottom(n)
-    #define DO(s, t, a) \
-        if (s == cmd && (t)) { a ; cmd = false; return true; }
-
-    DO(cmd,   KERR(k),             return false)
-    DO(cmd,   CODE(KEY_RESIZE),    reshape(root, 0, 0, LINES, COLS); SB)
-    DO(false, KEY(commandkey),     return cmd = true)
-    DO(false, KEY(0),              SENDN(n, "\000", 1); SB)
-    DO(false, KEY(L'\n'),          SEND(n, "\n"); SB)
-    DO(false, KEY(L'\r'),          SEND(n, n->lnm? "\r\n" : "\r"); SB)
-    DO(false, SCROLLUP && INSCR,   scrollback(n))
-    DO(false, SCROLLDOWN && INSCR, scrollforward(n))
-    DO(false, RECENTER && INSCR,   scrollbottom(n))
-    DO(false, CODE(KEY_ENTER),     SEND(n, n->lnm? "\r\n" : "\r"); SB)
-    DO(false, CODE(KEY_UP),        sendarrow(n, "A"); SB);
-    DO(false, CODE(KEY_DOWN),      sendarrow(n, "B"); SB);
-    DO(false, CODE(KEY_RIGHT),     sendarrow(n, "C"); SB);
-    DO(false, CODE(KEY_LEFT),      sendarrow(n, "D"); SB);
-    DO(false, CODE(KEY_HOME),      SEND(n, "\033[1~"); SB)
-    DO(false, CODE(KEY_END),       SEND(n, "\033[4~"); SB)
-    DO(false, CODE(KEY_PPAGE),     SEND(n, "\033[5~"); SB)
-    DO(false, CODE(KEY_NPAGE),     SEND(n, "\033[6~"); SB)
-    DO(false, CODE(KEY_BACKSPACE), SEND(n, "\177"); SB)
-    DO(false, CODE(KEY_DC),        SEND(n, "\033[3~"); SB)
-    DO(false, CODE(KEY_IC),        SEND(n, "\033[2~"); SB)
-    DO(false, CODE(KEY_BTAB),      SEND(n, "\033[Z"); SB)
-    DO(false, CODE(KEY_F(1)),      SEND(n, "\033OP"); SB)
-    DO(false, CODE(KEY_F(2)),      SEND(n, "\033OQ"); SB)
-    DO(false, CODE(KEY_F(3)),      SEND(n, "\033OR"); SB)
-    DO(false, CODE(KEY_F(4)),      SEND(n, "\033OS"); SB)
-    DO(false, CODE(KEY_F(5)),      SEND(n, "\033[15~"); SB)
-    DO(false, CODE(KEY_F(6)),      SEND(n, "\033[17~"); SB)
-    DO(false, CODE(KEY_F(7)),      SEND(n, "\033[18~"); SB)
-    DO(false, CODE(KEY_F(8)),      SEND(n, "\033[19~"); SB)
-    DO(false, CODE(KEY_F(9)),      SEND(n, "\033[20~"); SB)
-    DO(false, CODE(KEY_F(10)),     SEND(n, "\033[21~"); SB)
-    DO(false, CODE(KEY_F(11)),     SEND(n, "\033[23~"); SB)
-    DO(false, CODE(KEY_F(12)),     SEND(n, "\033[24~"); SB)
-    DO(true,  MOVE_UP,             focus(findnode(root, ABOVE(n))))
-    DO(true,  MOVE_DOWN,           focus(findnode(root, BELOW(n))))
-    DO(true,  MOVE_LEFT,           focus(findnode(root, LEFT(n))))
-    DO(true,  MOVE_RIGHT,          focus(findnode(root, RIGHT(n))))
-    DO(true,  MOVE_OTHER,          focus(lastfocused))
-    DO(true,  HSPLIT,              split(n, HORIZONTAL))
-    DO(true,  VSPLIT,              split(n, VERTICAL))
-    DO(true,  DELETE_NODE,         deletenode(n))
-    DO(true,  BAILOUT,             (void)1)
-    DO(true,  NUKE,                wclear(n->s->win))
-    DO(true,  REDRAW,              touchwin(stdscr); draw(root); redrawwin(stdscr))
-    DO(true,  SCROLLUP,            scrollback(n))
-    DO(true,  SCROLLDOWN,          scrollforward(n))
-    DO(true,  RECENTER,            scrollbottom(n))
-    DO(true,  KEY(commandkey),     SENDN(n, cmdstr, 1));
-    char c[MB_LEN_MAX + 1] = {0};
-    if (wctomb(c, k) > 0){
-        scrollbottom(n);
-        SEND(n, c);
+    bool code = r == KEY_CODE_YES;
+    BINDING *b = NULL;
+    if (r == ERR)
+        return false;
+
+    traceevent(EV_KEY, n->id, code? -k : k);
+    if (code && (k == KEY_PASTE_START || k == KEY_PASTE_END)){
+        /* Pasted text is typed as is; the brackets are only passed on to
+         * programs that asked for them. */
+        pasting = k == KEY_PASTE_START;
+        if (n->paste && !searching && !naming)
+            SEND(n, pasting? "\033[200~" : "\033[201~");
+        return cmd = false, true;
     }
-    return cmd = false, true;
+    if (searching)
+        return searchkey(r, k), true;
+    if (naming)
+        return namekey(r, k), true;
+    if (pasting && !code)
+        return sendchar(n, k), true;
+
+    if (!cmd && n->s->tos != n->s->off)
+        b = binding(BIND_SCROLLED, code, k);
+    if (!b || !b->a)
+        b = binding(cmd? BIND_COMMAND : BIND_KEY, code, k);
+    cmd = b && b->a == DO_COMMAND;
+    if (b && b->a)
+        act(n, b);
+    else
+        sendchar(n, k);
+    return true;
+}
+
+static void
+update(void) /* Update the host terminal. */
+{
+    size_t n = 0;
+    traceevent(EV_UPDATE, 0, 0);
+    mtm_define_pairs();
+    if (direct && !isendwin()) /* curses has to bring the terminal back */
+        totals.host += n = render(STDOUT_FILENO);
+    else
+        doupdate();
+    traceevent(EV_UPDATED, 0, (long)n);
+}
+
+static bool
+stalled(void) /* Is a paste waiting for the focused view to take its input? */
+{
+    return pasting && !searching && !naming && ringfree(focused->wq) < KEYROOM;
+}
+
+static int
+getkey(wint_t *w) /* Read a key, if there's a keyboard to read. */
+{
+    if (detached || stalled())
+        return ERR;
+    return wget_wch(focused->s->win, w);
 }
 
 static void
 run(void) /* Run MTM. */
 {
+    char b[100];
     while (root){
         wint_t w = 0;
-        fd_set sfds = fds;
-        if (select(nfds + 1, &sfds, NULL, NULL, NULL) < 0)
+        fd_set sfds = fds, wfds;
+        bool hurry = false; /* there are exports ready to go on */
+        bool held = false; /* there are views waiting for the next frame */
+        FD_ZERO(&wfds);
+        for (OBSERVER *o = observers; o; o = o->next) if (ringused(o->q))
+            FD_SET(o->fd, &wfds);
+        for (EXPORT *e = exports; e; e = e->next){
+            if (e->done < e->l)
+                FD_SET(e->fd, &wfds);
+            hurry |= e->done == e->l;
+        }
+        for (DESK *d = desks; d; d = d->next){
+            wantwrite(ROOT(d), &wfds);
+            held |= holdback(ROOT(d), &sfds);
+        }
+        if (stalled()) /* the rest of the paste waits in the host's buffer */
+            FD_CLR(STDIN_FILENO, &sfds);
+        for (LOG *g = logs; g; g = g->next){
+            if (ringused(g->q))
+                FD_SET(g->fd, &wfds);
+            if (LOG_BACKPRESSURE && g->n && g->n->pt >= 0 /* it's held up */
+             && ringfree(g->q) < MAX(ringused(g->n->rb), 1))
+                FD_CLR(g->n->pt, &sfds);
+        }
+        long long due = soonest(soonest(syncdue, winchdue),
+                                held? frameat + FRAME_TIME : 0);
+        for (GUEST *g = guests; g; g = g->next)
+            due = soonest(due, g->at + GREET_TIMEOUT);
+        long long t = hurry? 0 : due? MAX(due - now(), 0) : 0;
+        struct timeval tv = {t / 1000, t % 1000 * 1000};
+        int k = select(nfds + 1, &sfds, &wfds, NULL,
+                       hurry || due? &tv : NULL);
+        traceevent(EV_WAKE, 0, k);
+        if (k < 0)
             FD_ZERO(&sfds);
-
-        int r = wget_wch(focused->s->win, &w);
+        if (askfd[0] >= 0 && FD_ISSET(askfd[0], &sfds))
+            while (read(askfd[0], b, sizeof(b)) > 0)
+                ;
+        if (wantstats){
+            wantstats = 0;
+            writestats();
+        }
+        if (IO_THREAD && FD_ISSET(wakefd[0], &sfds))
+            while (read(wakefd[0], b, sizeof(b)) > 0)
+                ;
+        if (cfd >= 0 && FD_ISSET(cfd, &sfds))
+            hearclient();
+        if (guests)
+            hearguests(&sfds);
+        if (lfd >= 0 && FD_ISSET(lfd, &sfds))
+            greet();
+
+        int r = getkey(&w);
         while (handlechar(r, w))
-            r = wget_wch(focused->s->win, &w);
-        getinput(root, &sfds);
+            r = getkey(&w);
+        if (now() - frameat >= FRAME_TIME){
+            frameat = now();
+            for (DESK *d = desks; d; d = d->next)
+                newframe(ROOT(d));
+        }
+        for (DESK *d = desks; d; d = d->next) /* keys go in before output */
+            sendinput(ROOT(d));
+        getinput(&sfds);
+        if (observers)
+            feedobservers(&sfds);
+        if (exports)
+            feedexports();
+        if (logs)
+            feedlogs();
+
+        if (winchdue && winchdue <= now()){
+            winchdue = 0;
+            for (DESK *d = desks; d; d = d->next)
+                sendsizes(ROOT(d));
+        }
 
-        draw(root);
-        doupdate();
+        syncdue = 0;
+        if (detached) /* nobody to draw for */
+            continue;
+        t = nsnow();
+        draw(zoomed? zoomed : root);
         fixcursor();
-        draw(focused);
-        doupdate();
+        draw(focused); /* again, to leave the cursor in it */
+        update();
+        shown(zoomed? zoomed : root, nsnow());
+        totals.frames++;
+        totals.frame += nsnow() - t;
     }
 }
 
@@ -1144,14 +3853,52 @@ main(int argc, char **argv)
     FD_SET(STDIN_FILENO, &fds);
     setlocale(LC_ALL, "");
     signal(SIGCHLD, SIG_IGN); /* automatically reap children */
+    signal(SIGPIPE, SIG_IGN); /* clients and exports can go at any time */
 
     int c = 0;
-    while ((c = getopt(argc, argv, "c:T:t:")) != -1) switch (c){
+    char watch[32] = {0};
+    const char *keypath = NULL;
+    while ((c = getopt(argc, argv, "c:k:T:t:s:S:o:O:r")) != -1) switch (c){
         case 'c': commandkey = CTL(optarg[0]);      break;
+        case 'k': keypath = optarg;                 break;
+        case 's': sockpath = optarg;                break;
+        case 'S': statspath = optarg;               break;
+        case 'o': snprintf(watch, 32, "%c%s", SESSION_RAW, optarg);    break;
+        case 'O': snprintf(watch, 32, "%c%s", SESSION_SCREEN, optarg); break;
         case 'T': setenv("TERM", optarg, 1);        break;
         case 't': term = optarg;                    break;
+        case 'r': direct = true;                    break;
         default:  quit(EXIT_FAILURE, USAGE);        break;
     }
+    bindkeys();
+    if (keypath)
+        loadkeys(keypath);
+
+    if (watch[0] && (!sockpath || (c = sessionconnect(sockpath)) < 0))
+        quit(EXIT_FAILURE, sockpath? "no session to observe" : USAGE);
+    else if (watch[0])
+        return sessionobserve(c, watch);
+    if (sockpath && (c = sessionconnect(sockpath)) >= 0)
+        return sessionclient(c);
+    else if (sockpath)
+        serve();
+
+    started = now();
+    if (statspath){
+        struct sigaction sa = {.sa_handler = askstats, .sa_flags = SA_RESTART};
+        if (pipe(askfd) != 0)
+            quit(EXIT_FAILURE, "could not create pipe");
+        for (int i = 0; i < 2; i++){
+            fcntl(askfd[i], F_SETFL, O_NONBLOCK);
+            fcntl(askfd[i], F_SETFD, FD_CLOEXEC);
+        }
+        FD_SET(askfd[0], &fds);
+        nfds = MAX(nfds, askfd[0]);
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGUSR1, &sa, NULL);
+        if (TRACE_EVENTS && !starttrace(TRACE_EVENTS))
+            quit(EXIT_FAILURE, "could not allocate trace");
+    }
 
     if (!initscr())
         quit(EXIT_FAILURE, "could not initialize terminal");
@@ -1160,11 +3907,23 @@ main(int argc, char **argv)
     noecho();
     nonl();
     intrflush(stdscr, FALSE);
+    untouchwin(stdscr); /* only the dividers are ever drawn from stdscr */
     start_color();
     use_default_colors();
     start_pairs();
-
-    root = newview(NULL, 0, 0, LINES, COLS);
+    if (direct && !startrender(HOST_MARGINS))
+        direct = false;
+    define_key("\033[200~", KEY_PASTE_START);
+    define_key("\033[201~", KEY_PASTE_END);
+    hostpaste(true);
+    if (IO_THREAD)
+        startio();
+    for (int i = 0; i < EMULATION_THREADS; i++)
+        if (!spawn(worker, NULL))
+            quit(EXIT_FAILURE, "could not start thread");
+
+    desk = desks = calloc(1, sizeof(DESK));
+    root = desk? newview(NULL, 0, 0, LINES, COLS) : NULL;
     if (!root)
         quit(EXIT_FAILURE, "could not open root window");
     focus(root);
@@ -1,40 +1,237 @@
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 
 #include "config.h"
 
-#define COLOR_MAX 256
+/* Color pairs are found through a hash table keyed on their colors. Pairs
+ * are never redefined once text has been drawn with them, since that would
+ * recolor it; when the host runs out, colors that have no pair of their own
+ * get the existing pair nearest to them, and those answers are remembered
+ * in a little direct-mapped cache.
+ *
+ * Pairs are handed out by whichever thread is processing output, but only
+ * the main thread may touch curses' own pair table, so they are defined
+ * there, before the screen is next updated.
+ */
+#define NBUCKETS 4096 /* must be a power of two */
+#define MIN(x, y) ((x) < (y)? (x) : (y))
+#define MAX(x, y) ((x) > (y)? (x) : (y))
+
 typedef struct PAIR PAIR;
 struct PAIR{
-    short fg, bg, cp;
+    int fg, bg, chain; /* next pair in bucket */
+};
+
+typedef struct STAND STAND;
+struct STAND{
+    int fg, bg, p; /* p is the pair standing in for fg/bg */
+};
+
+static PAIR *pairs;
+static int buckets[NBUCKETS], npairs, maxpairs, ndefined;
+static pthread_mutex_t pairlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Colors are given to us as palette indexes, or as 24-bit RGB values with
+ * the ISRGB bit set. Hosts that can display direct color get RGB values as
+ * is; everybody else gets the nearest color in their palette. Finding that
+ * is cheap on 256-color hosts thanks to the regular layout of the color
+ * cube, but means a search on smaller ones, so recent answers are kept in
+ * a little direct-mapped cache.
+ */
+#define ISRGB    0x1000000
+#define NCACHE   256 /* must be a power of two */
+#define R(c)     ((c) >> 16 & 0xff)
+#define G(c)     ((c) >> 8 & 0xff)
+#define B(c)     ((c) & 0xff)
+#define FAR      (9 * 256 * 256) /* farther apart than any two colors */
+
+static int palette[256], ncolors;
+static unsigned char level[256]; /* nearest color cube level for a value */
+static bool direct;
+static uint64_t cache[NCACHE]; /* RGB value in the high bits, index below */
+static STAND stand[NCACHE];
+static const int levels[] = {0x00, 0x5f, 0x87, 0xaf, 0xd7, 0xff};
+static const int ansi[] ={
+    0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd,
+    0xe5e5e5, 0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff,
+    0x00ffff, 0xffffff
 };
 
-static PAIR pairs[COLOR_MAX * COLOR_MAX];
+static unsigned
+hash(int fg, int bg)
+{
+    unsigned h = (unsigned)fg * 2654435761u ^ (unsigned)bg * 40503u;
+    return (h ^ (h >> 15)) & (NBUCKETS - 1);
+}
+
+static int
+distance(int a, int b)
+{
+    int r = R(a) - R(b), g = G(a) - G(b), b2 = B(a) - B(b);
+    return 2 * r * r + 4 * g * g + 3 * b2 * b2;
+}
+
+static int
+nearest(int c) /* Find the palette index closest to RGB color c. */
+{
+    int best = 0;
+    if (ncolors >= 256){
+        int k = MIN(MAX((R(c) + G(c) + B(c)) / 3 - 3, 0) / 10, 23);
+        int cube = 16 + level[R(c)] * 36 + level[G(c)] * 6 + level[B(c)];
+        best = distance(c, palette[cube]) <= distance(c, palette[232 + k])?
+               cube : 232 + k;
+    } else for (int i = 1; i < MIN(ncolors, 16); i++)
+        if (distance(c, palette[i]) < distance(c, palette[best]))
+            best = i;
+    return best;
+}
+
+static int
+quantize(int c) /* Find the nearest palette index, asking the cache first. */
+{
+    uint64_t *e = cache + (hash(c, c >> 12) & (NCACHE - 1));
+    uint64_t v = __atomic_load_n(e, __ATOMIC_RELAXED);
+    if (v >> 16 == (uint64_t)(c | ISRGB))
+        return v & 0xffff;
+
+    int i = nearest(c);
+    __atomic_store_n(e, (uint64_t)(c | ISRGB) << 16 | i, __ATOMIC_RELAXED);
+    return i;
+}
+
+int
+mtm_color(int c) /* Map a palette index or RGB color to a host color. */
+{
+    if (c < 0 || ncolors < 8)
+        return -1;
+    if (direct){ /* small RGB values might be taken as palette indexes */
+        if (!(c & ISRGB) && c < 8)
+            return c;
+        c = (c & ISRGB)? c & 0xffffff : palette[c & 0xff];
+        return c < 0x100? c | 0x100 : c; /* off by an imperceptible green */
+    }
+    if (!(c & ISRGB) && c < (ncolors >= 256? 256 : MIN(ncolors, 16)))
+        return c;
+    return quantize((c & ISRGB)? c & 0xffffff : palette[c & 0xff]);
+}
 
 void
 start_pairs(void)
 {
-    for (int i = 0; i < COLOR_MAX * COLOR_MAX; i++)
-        pairs[i].fg = pairs[i].bg = pairs[i].cp = -1;
+    ncolors = COLORS;
+    direct = COLORS >= ISRGB;
+    for (int i = 0; i < 256; i++){
+        int n = 0, g = 8 + (i - 232) * 10;
+        while (n < 5 && i > (levels[n] + levels[n + 1]) / 2)
+            n++;
+        level[i] = n;
+        if (i < 16)
+            palette[i] = ansi[i];
+        else if (i < 232)
+            palette[i] = levels[(i - 16) / 36] << 16
+                       | levels[(i - 16) / 6 % 6] << 8 | levels[(i - 16) % 6];
+        else
+            palette[i] = g << 16 | g << 8 | g;
+    }
+
+    maxpairs = MIN(COLOR_PAIRS - 1, SHRT_MAX);
+    pairs = calloc(MAX(maxpairs, 0) + 1, sizeof(PAIR));
+    if (!pairs)
+        maxpairs = 0;
+    for (int i = 0; i < NCACHE; i++)
+        stand[i].p = -1;
 }
 
-short
-mtm_alloc_pair(int fg, int bg)
+static int
+rgb(int c) /* The RGB value of host color c. */
+{
+    return direct && c >= 8? c & 0xffffff : palette[c & 0xff];
+}
+
+static int
+apart(int a, int b) /* How far apart host colors a and b look. */
+{
+    if (a < 0 || b < 0) /* the defaults are only near themselves */
+        return a == b? 0 : FAR;
+    return distance(rgb(a), rgb(b));
+}
+
+static short
+standin(int fg, int bg) /* Find the existing pair nearest to fg/bg. */
+{
+    STAND *e = stand + (hash(fg, bg) & (NCACHE - 1));
+    if (e->p >= 0 && e->fg == fg && e->bg == bg)
+        return e->p;
+
+    int best = 0, d = apart(fg, -1) + apart(bg, -1); /* pair 0 */
+    for (int p = 1; p <= npairs; p++){
+        int dp = apart(fg, pairs[p].fg) + apart(bg, pairs[p].bg);
+        if (dp < d)
+            best = p, d = dp;
+    }
+    e->fg = fg;
+    e->bg = bg;
+    e->p = best;
+    return best;
+}
+
+static short
+findpair(int fg, int bg)
 {
 #if USE_ALLOC_PAIR
     return alloc_pair(fg, bg);
 #else
-    if (fg >= COLOR_MAX || bg >= COLOR_MAX)
-       return -1;
-    for (int i = 0; i < COLOR_MAX * COLOR_MAX; i++){
-        PAIR *p = pairs + i;
-        if (p->cp == -1){
-            p->fg = fg;
-            p->bg = bg;
-            p->cp = init_pair(i + 1, p->fg, p->bg) == OK? i + 1 : -1;
-        }
-        if (p->fg == fg && p->bg == bg && p->cp != -1)
-            return p->cp;
-    }
-    return -1;
+    int p = 0;
+    if (fg == -1 && bg == -1)
+        return 0;
+    for (p = buckets[hash(fg, bg)]; p; p = pairs[p].chain)
+        if (pairs[p].fg == fg && pairs[p].bg == bg)
+            return p;
+
+    if (npairs == maxpairs)
+        return standin(fg, bg);
+
+    p = ++npairs;
+    pairs[p].fg = fg;
+    pairs[p].bg = bg;
+    pairs[p].chain = buckets[hash(fg, bg)];
+    buckets[hash(fg, bg)] = p;
+    return p;
 #endif
 }
+
+short
+mtm_alloc_pair(int fg, int bg) /* may be called from several threads */
+{
+    pthread_mutex_lock(&pairlock);
+    short p = findpair(fg, bg);
+    pthread_mutex_unlock(&pairlock);
+    return p;
+}
+
+int
+mtm_pairs_used(void)
+{
+    pthread_mutex_lock(&pairlock);
+    int n = npairs;
+    pthread_mutex_unlock(&pairlock);
+    return n;
+}
+
+void
+mtm_define_pairs(void) /* define the pairs handed out since; main thread only */
+{
+    pthread_mutex_lock(&pairlock);
+    for (; ndefined < npairs; ndefined++){
+        int p = ndefined + 1;
+#if NCURSES_EXT_COLORS
+        init_extended_pair(p, pairs[p].fg, pairs[p].bg);
+#else
+        init_pair(p, pairs[p].fg, pairs[p].bg);
+#endif
+    }
+    pthread_mutex_unlock(&pairlock);
+}
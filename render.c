@@ -0,0 +1,524 @@
+#include <errno.h>
+#include <langinfo.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "render.h"
+#include "wcurses.h"
+#include "width.h"
+
+#define MAX(x, y) ((x) > (y)? (x) : (y))
+#define CAP(s, a, b) tparm((s), (long)(a), (long)(b), 0L, 0L, 0L, 0L, 0L, 0L, \
+                          0L)
+#define SKIP 4 /* unchanged cells rewritten rather than moved over */
+#define ERASE 8 /* blanks erased rather than written */
+#define MOTION 32 /* longest cursor motion worth considering */
+#define SCROLL 48 /* cells a scroll has to save to be worth sending */
+
+typedef struct HINT HINT;
+struct HINT{
+    int y, x, h, w, k;
+};
+
+static cchar_t *shown, *want, *row, cont; /* cont is a wide char's right half */
+static cchar_t space;
+static int lines, cols, cury = -1, curx = -1;
+static bool known, styled; /* the screen and the rendition are known */
+static bool utf8, xenl, am, bce, ecma; /* ecma: sgr0 resets the colors */
+static attr_t cura;
+static short curp;
+static int curfg = -1, curbg = -1;
+static char *out;
+static size_t nout, maxout;
+static bool lost; /* ran out of memory building this frame */
+static HINT *hints; /* regions that have scrolled since the last frame */
+static int nhints, maxhints;
+
+static const char *cup, *cr, *hpa, *vpa, *cuf, *cub, *cud, *cuu, *clr,
+                  *el, *ech, *sgr0, *op, *setaf, *setab, *smacs, *rmacs,
+                  *csr, *ind, *indn, *ri, *rin, *smglr, *mgc;
+static const struct{ attr_t a; const char *name; } modes[] ={
+    {A_BOLD, "bold"}, {A_DIM, "dim"}, {A_UNDERLINE, "smul"},
+    {A_BLINK, "blink"}, {A_REVERSE, "rev"}, {A_INVIS, "invis"},
+    {A_STANDOUT, "smso"},
+    #if defined(A_ITALIC) /* only there if mtm was built to use it */
+    {A_ITALIC, "sitm"},
+    #endif
+};
+static const char *modecaps[sizeof(modes) / sizeof(modes[0])];
+
+/* Curses draws the dividers with the alternate character set, which is
+ * sent as Unicode when the locale allows it.
+ */
+static const wchar_t acs[128] ={
+    ['j'] = 0x2518, ['k'] = 0x2510, ['l'] = 0x250c, ['m'] = 0x2514,
+    ['n'] = 0x253c, ['q'] = 0x2500, ['t'] = 0x251c, ['u'] = 0x2524,
+    ['v'] = 0x2534, ['w'] = 0x252c, ['x'] = 0x2502, ['a'] = 0x2592,
+    ['`'] = 0x25c6, ['f'] = 0x00b0, ['g'] = 0x00b1, ['~'] = 0x00b7
+};
+
+static const char *
+getcap(const char *n) /* Look up a string capability, or NULL. */
+{
+    char *s = tigetstr((char *)n);
+    return s == (char *)-1? NULL : s;
+}
+
+bool
+startrender(bool margins)
+{
+    cup = getcap("cup");
+    cr = getcap("cr");
+    hpa = getcap("hpa");
+    vpa = getcap("vpa");
+    cuf = getcap("cuf");
+    cub = getcap("cub");
+    cud = getcap("cud");
+    cuu = getcap("cuu");
+    clr = getcap("clear");
+    el = getcap("el");
+    ech = getcap("ech");
+    sgr0 = getcap("sgr0");
+    op = getcap("op");
+    setaf = getcap("setaf");
+    setab = getcap("setab");
+    smacs = getcap("smacs");
+    rmacs = getcap("rmacs");
+    csr = getcap("csr");
+    ind = getcap("ind");
+    indn = getcap("indn");
+    ri = getcap("ri");
+    rin = getcap("rin");
+    smglr = margins? getcap("smglr") : NULL;
+    mgc = margins? getcap("mgc") : NULL;
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+        modecaps[i] = getcap(modes[i].name);
+    am = tigetflag("am") > 0;
+    xenl = tigetflag("xenl") > 0;
+    bce = tigetflag("bce") > 0;
+    utf8 = strcmp(nl_langinfo(CODESET), "UTF-8") == 0;
+    ecma = sgr0 && (strstr(sgr0, "\033[m") || strstr(sgr0, "\033[0m"));
+    setcchar(&space, L" ", A_NORMAL, 0, NULL);
+    return cup && clr && sgr0;
+}
+
+static void
+put(const char *s, size_t n) /* Add to the frame. */
+{
+    if (nout + n > maxout){
+        size_t m = MAX(maxout * 2, nout + n + 4096);
+        char *o = realloc(out, m);
+        if (!o){
+            lost = true;
+            return;
+        }
+        out = o;
+        maxout = m;
+    }
+    memcpy(out + nout, s, n);
+    nout += n;
+}
+
+static void
+putcap(const char *s) /* Add a capability, if there is one, to the frame. */
+{
+    if (s)
+        put(s, strlen(s));
+}
+
+static void
+colors(short p, int *fg, int *bg) /* Find out what colors a pair stands for. */
+{
+    #if NCURSES_EXT_COLORS
+    extended_pair_content(p, fg, bg);
+    #else
+    short sfg = -1, sbg = -1;
+    pair_content(p, &sfg, &sbg);
+    *fg = sfg;
+    *bg = sbg;
+    #endif
+}
+
+static void
+reset(void) /* Go back to the default rendition. */
+{
+    if (styled && !cura && curfg < 0 && curbg < 0)
+        return;
+    putcap(sgr0);
+    if (!styled || ((curfg >= 0 || curbg >= 0) && !ecma))
+        putcap(op);
+    if (!styled || (cura & A_ALTCHARSET))
+        putcap(rmacs);
+    cura = 0;
+    curp = 0;
+    curfg = curbg = -1;
+    styled = true;
+}
+
+static void
+style(attr_t a, short p) /* Change to a rendition, sending only what's new. */
+{
+    int fg = curfg, bg = curbg;
+    if (!utf8 && smacs)
+        a &= A_ATTRIBUTES & ~A_COLOR;
+    else
+        a &= A_ATTRIBUTES & ~A_COLOR & ~A_ALTCHARSET;
+    if (styled && a == cura && p == curp)
+        return;
+
+    if (!styled || p != curp)
+        colors(p, &fg, &bg);
+    if (!styled || (cura & ~a) || (fg < 0 && curfg >= 0)
+     || (bg < 0 && curbg >= 0)) /* something has to be turned off */
+        reset();
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+        if (a & ~cura & modes[i].a)
+            putcap(modecaps[i]);
+    if (a & ~cura & A_ALTCHARSET)
+        putcap(smacs);
+    if (fg >= 0 && fg != curfg && setaf)
+        putcap(CAP(setaf, fg, 0));
+    if (bg >= 0 && bg != curbg && setab)
+        putcap(CAP(setab, bg, 0));
+    cura = a;
+    curp = p;
+    curfg = fg;
+    curbg = bg;
+}
+
+static void
+putcell(const cchar_t *c) /* Add a cell's characters to the frame. */
+{
+    wchar_t wc[CCHARW_MAX + 1] = {0};
+    attr_t a = 0;
+    short p = 0;
+    char mb[MB_LEN_MAX];
+    getcchar(c, wc, &a, &p, NULL);
+    style(a, p);
+    if ((a & A_ALTCHARSET) && (utf8 || !smacs) && wc[0] > 0 && wc[0] < 128)
+        wc[0] = utf8 && acs[wc[0]]? acs[wc[0]]
+              : wc[0] == L'x'? L'|' : wc[0] == L'q'? L'-' : L'+';
+    for (int i = 0; i == 0 || (i < CCHARW_MAX && wc[i]); i++){
+        mbstate_t ms = {0};
+        size_t k = wcrtomb(mb, wc[i]? wc[i] : L' ', &ms);
+        if (k != (size_t)-1)
+            put(mb, k);
+        else if (i == 0)
+            put("?", 1);
+    }
+}
+
+static int
+width(const cchar_t *c)
+{
+    return c->chars[0] < 0x7f? 1 : MAX(charwidth(c->chars[0]), 1);
+}
+
+static bool
+same(const cchar_t *a, const cchar_t *b)
+{
+    return memcmp(a, b, sizeof(cchar_t)) == 0;
+}
+
+static short
+blank(const cchar_t *c) /* The pair of a plain blank, or -1 for others. */
+{
+    wchar_t wc[CCHARW_MAX + 1] = {0};
+    attr_t a = 0;
+    short p = 0;
+    getcchar(c, wc, &a, &p, NULL);
+    return wc[0] == L' ' && !wc[1] && !(a & A_ATTRIBUTES & ~A_COLOR)? p : -1;
+}
+
+static bool
+rewrite(int y, int x) /* Write the cells up to x again, if that's shorter. */
+{
+    /* A few cells can be written again for less than it takes to move
+     * over them, if they don't need a change of rendition. */
+    cchar_t *o = shown + y * cols;
+    if (y != cury || x <= curx || curx < 0 || x - curx > SKIP)
+        return false;
+    for (int i = curx; i < x; i++){
+        attr_t a = 0;
+        short p = 0;
+        wchar_t wc[CCHARW_MAX + 1] = {0};
+        getcchar(o + i, wc, &a, &p, NULL);
+        if (same(o + i, &cont) || width(o + i) != 1 || p != curp
+         || (a & A_ATTRIBUTES & ~A_COLOR) != cura)
+            return false;
+    }
+    for (int i = curx; i < x; i++)
+        putcell(o + i);
+    curx = x;
+    return true;
+}
+
+static void
+shortest(char *b, const char *s, int n) /* Keep s in b if it's shorter. */
+{
+    if (s && n >= 0 && strlen(s) < MOTION && (!*b || strlen(s) < strlen(b)))
+        strcpy(b, s);
+}
+
+static void
+moveto(int y, int x) /* Move the host cursor, as cheaply as we can. */
+{
+    char c[MOTION] = {0}, v[MOTION] = {0}, h[MOTION] = {0};
+    if ((y == cury && x == curx) || rewrite(y, x))
+        return;
+
+    /* Absolute addressing always works. When we know where we are, moving
+     * up or down and then across may be shorter. */
+    shortest(c, CAP(cup, y, x), 0);
+    if (cury >= 0 && y != cury){
+        shortest(v, vpa? CAP(vpa, y, 0) : NULL, 0);
+        shortest(v, y > cury && cud? CAP(cud, y - cury, 0) : NULL, 0);
+        shortest(v, y < cury && cuu? CAP(cuu, cury - y, 0) : NULL, 0);
+        shortest(v, y == cury + 1 && x == 0? "\r\n" : NULL, 0);
+    }
+    bool nl = strcmp(v, "\r\n") == 0; /* that takes care of x too */
+    if (cury >= 0 && x != curx && !nl){
+        shortest(h, x == 0? cr : NULL, 0);
+        shortest(h, hpa? CAP(hpa, x, 0) : NULL, 0);
+        shortest(h, x > curx && cuf? CAP(cuf, x - curx, 0) : NULL, curx);
+        shortest(h, x < curx && cub? CAP(cub, curx - x, 0) : NULL, curx);
+    }
+    if (cury >= 0 && (y == cury || *v) && (x == curx || *h || nl)
+     && strlen(v) + strlen(h) < strlen(c)){
+        putcap(v);
+        putcap(h);
+    } else
+        putcap(c);
+    cury = y;
+    curx = x;
+}
+
+static void
+fetch(int y, int x, int n) /* Get n cells of a line of newscr into want. */
+{
+    mvwin_wchnstr(newscr, y, x, row, n);
+    for (int i = 0, j = 0; j < n; i++){ /* curses leaves out right halves */
+        want[j++] = row[i];
+        if (width(row + i) > 1 && j < n)
+            want[j++] = cont;
+    }
+}
+
+static void
+drawrow(int y) /* Send the changes to a line. */
+{
+    cchar_t *o = shown + y * cols;
+    int end = cols;
+    fetch(y, 0, cols);
+
+    /* Blanks at the end of the line can be cleared instead of written, in
+     * their own background color if the host clears that way. */
+    short bg = blank(want + cols - 1);
+    if (bg > 0 && !bce)
+        bg = -1;
+    while (end > 0 && bg >= 0 && blank(want + end - 1) == bg)
+        end--;
+
+    for (int x = 0; x < cols; x++){
+        if (same(o + x, want + x) || same(want + x, &cont))
+            continue;
+        if (x >= end && el){
+            style(A_NORMAL, bg);
+            moveto(y, x);
+            putcap(el);
+            memcpy(o + x, want + x, (cols - x) * sizeof(cchar_t));
+            return;
+        }
+
+        short q = blank(want + x);
+        int r = 1;
+        while (ech && q >= 0 && (!q || bce) && x + r < end
+            && blank(want + x + r) == q)
+            r++;
+        if (r >= ERASE){ /* a run of blanks can be erased in one go */
+            style(A_NORMAL, q);
+            moveto(y, x);
+            putcap(CAP(ech, r, 0));
+            memcpy(o + x, want + x, r * sizeof(cchar_t));
+            x += r - 1;
+            continue;
+        }
+
+        int w = width(want + x);
+        if (am && !xenl && y == lines - 1 && x + w >= cols)
+            return; /* writing the last cell would scroll the screen */
+        moveto(y, x);
+        putcell(want + x);
+        o[x] = want[x];
+        if (w > 1 && x + 1 < cols)
+            o[++x] = cont;
+        curx = x + 1;
+        if (curx >= cols) /* we're at the margin, or past it */
+            curx = -1;
+        if (curx < 0 && !xenl)
+            cury = -1;
+    }
+}
+
+static bool
+worthit(const HINT *s) /* Would scrolling the host save more than it costs? */
+{
+    /* What a scroll saves is the lines it puts in place that would
+     * otherwise have to be drawn again, less their blanks. */
+    size_t n = s->w * sizeof(cchar_t);
+    int saved = 0;
+    for (int i = MAX(-s->k, 0); i < s->h && i + s->k < s->h; i++){
+        cchar_t *o = shown + (s->y + i) * cols + s->x;
+        cchar_t *f = o + s->k * cols;
+        fetch(s->y + i, s->x, s->w);
+        if (memcmp(want, o, n) == 0 || memcmp(want, f, n) != 0)
+            continue;
+        for (int j = 0; j < s->w; j++)
+            saved += blank(f + j) != 0;
+    }
+    return saved > SCROLL;
+}
+
+static void
+slide(const HINT *s) /* Scroll a region of the host screen. */
+{
+    /* Lines scrolled in are blank, in the background color on bce hosts,
+     * so the default rendition is set first. Setting the margins sends
+     * the cursor home. */
+    int k = abs(s->k);
+    const char *one = s->k > 0? ind : ri, *many = s->k > 0? indn : rin;
+    bool part = s->x > 0 || s->w < cols;
+    reset();
+    putcap(CAP(csr, s->y, s->y + s->h - 1));
+    if (part)
+        putcap(CAP(smglr, s->x, s->x + s->w - 1));
+    cury = curx = -1;
+    moveto(s->k > 0? s->y + s->h - 1 : s->y, s->x);
+    if (many && (k > 1 || !one))
+        putcap(CAP(many, k, 0));
+    else{
+        for (int i = 0; i < k; i++)
+            putcap(one);
+    }
+    if (part)
+        putcap(mgc);
+    putcap(CAP(csr, 0, lines - 1));
+    cury = curx = -1;
+
+    for (int i = 0; i < s->h; i++){
+        int to = s->k > 0? i : s->h - 1 - i, from = to + s->k;
+        cchar_t *o = shown + (s->y + to) * cols + s->x;
+        if (from >= 0 && from < s->h)
+            memcpy(o, o + s->k * cols, s->w * sizeof(cchar_t));
+        else{
+            for (int j = 0; j < s->w; j++)
+                o[j] = space;
+        }
+    }
+    touchline(newscr, s->y, s->h); /* lines that didn't change may now */
+}
+
+static bool
+resize(void) /* Make room for a screen of the current size. */
+{
+    size_t n = (size_t)LINES * COLS;
+    cchar_t *s = realloc(shown, n * sizeof(cchar_t));
+    if (s)
+        shown = s;
+    cchar_t *w = s? realloc(want, (COLS + 1) * sizeof(cchar_t)) : NULL;
+    if (w)
+        want = w;
+    cchar_t *r = w? realloc(row, (COLS + 1) * sizeof(cchar_t)) : NULL;
+    if (r)
+        row = r;
+    if (!r)
+        return false;
+    lines = LINES;
+    cols = COLS;
+    return true;
+}
+
+static void
+wipe(void) /* Clear the host screen, and remember that we did. */
+{
+    reset();
+    putcap(clr);
+    for (int i = 0; i < lines * cols; i++)
+        shown[i] = space;
+    cury = curx = 0;
+    known = true;
+}
+
+size_t
+render(int fd)
+{
+    int y = 0, x = 0;
+    bool all = !known || lines != LINES || cols != COLS;
+    if (all && (lines != LINES || cols != COLS) && !resize())
+        return 0;
+
+    getyx(newscr, y, x);
+    nout = 0;
+    lost = false;
+    if (all){
+        styled = false;
+        wipe();
+    }
+    for (int i = 0; i < nhints && !all; i++)
+        if (worthit(hints + i))
+            slide(hints + i);
+    nhints = 0;
+    for (int i = 0; i < lines; i++)
+        if (all || is_linetouched(newscr, i))
+            drawrow(i);
+    untouchwin(newscr);
+    wmove(newscr, y, x);
+    if (y >= 0 && y < lines && x >= 0 && x < cols)
+        moveto(y, x);
+
+    if (lost){ /* what we have of the frame is no good; start over */
+        known = false;
+        return 0;
+    }
+    for (size_t w = 0; w < nout;){
+        ssize_t s = write(fd, out + w, nout - w);
+        if (s < 0 && errno != EINTR){
+            known = false;
+            return w;
+        }
+        w += s < 0? 0 : (size_t)s;
+    }
+    return nout;
+}
+
+void
+forgetscreen(void)
+{
+    known = false;
+    nhints = 0;
+}
+
+void
+scrollhint(int y, int x, int h, int w, int k)
+{
+    /* Only regions that fit on the screen, scrolled less than their height,
+     * can be scrolled on the host; margins are needed unless they're as
+     * wide as the screen. */
+    if (!known || isendwin() || !k || abs(k) >= h || !csr
+     || (k > 0? !ind && !indn : !ri && !rin)
+     || ((x > 0 || w < cols) && (!smglr || !mgc))
+     || y < 0 || x < 0 || y + h > lines || x + w > cols)
+        return;
+    if (nhints == maxhints){
+        int m = MAX(maxhints * 2, 16);
+        HINT *t = realloc(hints, m * sizeof(HINT));
+        if (!t)
+            return;
+        hints = t;
+        maxhints = m;
+    }
+    hints[nhints++] = (HINT){y, x, h, w, k};
+}
@@ -0,0 +1,31 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The direct renderer puts the curses virtual screen (newscr) on the host
+ * terminal itself, instead of leaving that to doupdate(3X). Windows are
+ * still copied into newscr as usual, which marks the lines that changed;
+ * each frame, those lines are compared with what the host is known to be
+ * showing, and the differences are sent as cursor motions, the smallest
+ * rendition changes that will do, and text, all in a single write(2).
+ * Regions of the screen that have scrolled are scrolled on the host first,
+ * when that saves enough, so that only the lines scrolled in are sent.
+ */
+bool
+startrender(bool margins); /* look up capabilities, using left and right
+                              margins only if margins is true; false if the
+                              host lacks what's needed */
+
+size_t
+render(int fd); /* send a frame to fd; return the number of bytes sent */
+
+void
+forgetscreen(void); /* the host screen is unknown; clear it and start over */
+
+void
+scrollhint(int y, int x, int h, int w, int k); /* the h by w region at y,x
+                                                  has scrolled up k lines */
+
+#endif
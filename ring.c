@@ -0,0 +1,115 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+#define LOAD(x)     __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define MIN(x, y) ((x) < (y)? (x) : (y))
+
+RING *
+newring(size_t size)
+{
+    RING *r = calloc(1, sizeof(RING) + size);
+    if (r)
+        r->size = size;
+    return r;
+}
+
+size_t
+ringused(RING *r)
+{
+    return LOAD(r->head) - LOAD(r->tail);
+}
+
+size_t
+ringfree(RING *r)
+{
+    return r->size - ringused(r);
+}
+
+size_t
+ringroom(RING *r)
+{
+    size_t n = ringfree(r);
+    if (!n){
+        __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+        n = ringfree(r); /* the consumer may have made room meanwhile */
+    }
+    return n;
+}
+
+ssize_t
+ringfill(RING *r, int fd)
+{
+    size_t head = r->head, free = r->size - (head - LOAD(r->tail));
+    size_t o = head & (r->size - 1), n = MIN(free, r->size - o);
+    struct iovec iov[2] = {{r->buf + o, n}, {r->buf, free - n}};
+    if (!free)
+        return errno = EAGAIN, -1;
+
+    ssize_t s = readv(fd, iov, iov[1].iov_len? 2 : 1);
+    if (s > 0)
+        STORE(r->head, head + (size_t)s);
+    return s;
+}
+
+bool
+ringput(RING *r, const char *s, size_t n)
+{
+    size_t head = r->head, o = head & (r->size - 1), k = MIN(n, r->size - o);
+    if (ringfree(r) < n)
+        return false;
+
+    memcpy(r->buf + o, s, k);
+    memcpy(r->buf, s + k, n - k);
+    STORE(r->head, head + n);
+    return true;
+}
+
+void
+ringclose(RING *r)
+{
+    STORE(r->eof, 1);
+}
+
+bool
+ringclosed(RING *r)
+{
+    return LOAD(r->eof);
+}
+
+bool
+ringeof(RING *r)
+{
+    return LOAD(r->eof) && !ringused(r);
+}
+
+size_t
+ringpeek(RING *r, const char **s)
+{
+    size_t tail = r->tail, o = tail & (r->size - 1);
+    *s = r->buf + o;
+    return MIN(LOAD(r->head) - tail, r->size - o);
+}
+
+bool
+ringdrop(RING *r, size_t n)
+{
+    __atomic_store_n(&r->tail, r->tail + n, __ATOMIC_SEQ_CST);
+    return __atomic_exchange_n(&r->waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+ssize_t
+ringflush(RING *r, int fd)
+{
+    const char *s = NULL;
+    size_t n = ringpeek(r, &s);
+    ssize_t w = n? write(fd, s, n) : 0;
+    if (w > 0)
+        ringdrop(r, (size_t)w);
+    return w;
+}
@@ -0,0 +1,55 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* A RING is a single-producer, single-consumer byte queue. The producer
+ * and consumer may be on different threads; neither ever takes a lock.
+ */
+typedef struct RING RING;
+struct RING{
+    size_t size, head, tail;
+    int eof, waiting;
+    char buf[];
+};
+
+RING *
+newring(size_t size); /* size must be a power of two */
+
+size_t
+ringused(RING *r);
+
+size_t
+ringfree(RING *r);
+
+size_t
+ringroom(RING *r); /* producer: like ringfree, but note if we must wait */
+
+ssize_t
+ringfill(RING *r, int fd); /* producer: read(2) from fd into free space */
+
+bool
+ringput(RING *r, const char *s, size_t n); /* producer: add all of s or none */
+
+void
+ringclose(RING *r); /* producer: no more data will be added */
+
+bool
+ringclosed(RING *r); /* ring has been closed, though data may be pending */
+
+bool
+ringeof(RING *r); /* consumer: ring is closed and empty */
+
+size_t
+ringpeek(RING *r, const char **s); /* consumer: get contiguous pending data */
+
+bool
+ringdrop(RING *r, size_t n); /* consumer: release n bytes, true if the
+                                producer was waiting for room */
+
+ssize_t
+ringflush(RING *r, int fd); /* consumer: write(2) pending data to fd */
+
+#endif
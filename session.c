@@ -0,0 +1,176 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "session.h"
+
+#define MAXFDS 3
+
+static int sock = -1;
+
+static int
+address(struct sockaddr_un *a, const char *path)
+{
+    memset(a, 0, sizeof(*a));
+    a->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(a->sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(a->sun_path, path);
+    return 0;
+}
+
+int
+sessionlisten(const char *path)
+{
+    struct sockaddr_un a;
+    struct stat st;
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0 || address(&a, path) < 0)
+        goto fail;
+
+    /* Nobody is listening on it, so a socket there is left over from a
+     * session that died; anything else is somebody's file. */
+    if (lstat(path, &st) == 0 && !S_ISSOCK(st.st_mode)){
+        errno = EEXIST;
+        goto fail;
+    }
+    unlink(path);
+    mode_t m = umask(0077);
+    int r = bind(s, (struct sockaddr *)&a, sizeof(a));
+    umask(m);
+    if (r < 0 || listen(s, 8) < 0)
+        goto fail;
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+    return s;
+
+fail:
+    if (s >= 0)
+        close(s);
+    return -1;
+}
+
+int
+sessionconnect(const char *path)
+{
+    struct sockaddr_un a;
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0 || address(&a, path) < 0
+     || connect(s, (struct sockaddr *)&a, sizeof(a)) < 0){
+        if (s >= 0)
+            close(s);
+        return -1;
+    }
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+    return s;
+}
+
+static int
+attach(int s) /* Hand our stdin, stdout and stderr to the server. */
+{
+    int fds[MAXFDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char c = SESSION_ATTACH, buf[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec v = {.iov_base = &c, .iov_len = 1};
+    struct msghdr m = {.msg_iov = &v, .msg_iovlen = 1,
+                       .msg_control = buf, .msg_controllen = sizeof(buf)};
+    struct cmsghdr *h = CMSG_FIRSTHDR(&m);
+    h->cmsg_level = SOL_SOCKET;
+    h->cmsg_type = SCM_RIGHTS;
+    h->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(h), fds, sizeof(fds));
+    return sendmsg(s, &m, 0) == 1? 0 : -1;
+}
+
+int
+sessionrecv(int s, char *m, size_t n, int *fds, int *nfds)
+{
+    char buf[CMSG_SPACE(sizeof(int) * MAXFDS)] = {0};
+    struct iovec v = {.iov_base = m, .iov_len = n - 1};
+    struct msghdr h = {.msg_iov = &v, .msg_iovlen = 1,
+                       .msg_control = buf, .msg_controllen = sizeof(buf)};
+    ssize_t r = recvmsg(s, &h, 0);
+    int got = 0, all[MAXFDS];
+
+    struct cmsghdr *c = r > 0? CMSG_FIRSTHDR(&h) : NULL;
+    if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS){
+        got = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        got = got < MAXFDS? got : MAXFDS;
+        memcpy(all, CMSG_DATA(c), sizeof(int) * got);
+    }
+    for (int i = 0; i < got; i++){ /* keep what fits, close the rest */
+        if (i < *nfds)
+            fds[i] = all[i];
+        else
+            close(all[i]);
+    }
+    *nfds = got < *nfds? got : *nfds;
+    if (r <= 0)
+        return -1;
+    m[r] = 0;
+    return (int)r;
+}
+
+static void
+resized(int sig)
+{
+    char c = SESSION_RESIZE;
+    (void)sig;
+    if (write(sock, &c, 1) < 0)
+        return; /* the server will notice we've gone soon enough */
+}
+
+int
+sessionclient(int s)
+{
+    char c = 0;
+    ssize_t r = 0;
+    bool detached = false;
+
+    sock = s;
+    signal(SIGWINCH, resized);
+    if (attach(s) < 0){
+        perror("mtm: could not attach");
+        return EXIT_FAILURE;
+    }
+    while ((r = read(s, &c, 1)) != 0){
+        if (r < 0 && errno != EINTR)
+            break;
+        detached = detached || (r > 0 && c == SESSION_DETACH);
+    }
+    if (detached)
+        fprintf(stderr, "[detached]\n");
+    return EXIT_SUCCESS;
+}
+
+int
+sessionobserve(int s, const char *m)
+{
+    char buf[BUFSIZ];
+    ssize_t r = 0;
+    if (write(s, m, strlen(m)) < 0){
+        perror("mtm: could not observe");
+        return EXIT_FAILURE;
+    }
+    while ((r = read(s, buf, sizeof(buf))) != 0){
+        ssize_t o = 0, w = 0;
+        if (r < 0 && errno != EINTR)
+            break;
+        while (o < r){
+            w = write(STDOUT_FILENO, buf + o, r - o);
+            if (w < 0 && errno != EINTR)
+                return EXIT_FAILURE;
+            o += w > 0? w : 0;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,37 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+
+/* A session is an mtm server listening on a Unix domain socket. Clients
+ * attach by connecting and handing over their terminal; after that they
+ * only forward window size changes until the server lets them go.
+ * Observers connect to watch a single view, naming it in their first
+ * message, and are sent its output until either side hangs up.
+ */
+#define SESSION_ATTACH 'a' /* client to server: take my terminal */
+#define SESSION_RAW    'r' /* client to server: send me a view's output */
+#define SESSION_SCREEN 's' /* client to server: send me a view's screen */
+#define SESSION_RESIZE 'w' /* client to server: the terminal changed size */
+#define SESSION_DETACH 'd' /* server to client: you've been detached */
+
+int
+sessionlisten(const char *path); /* returns listening socket or -1; fails
+                                    with EEXIST if path isn't a socket */
+
+int
+sessionconnect(const char *path); /* returns connected socket or -1 */
+
+int
+sessionrecv(int s, char *m, size_t n, int *fds, int *nfds);
+    /* server: get a message of up to n - 1 bytes, and up to *nfds
+       descriptors passed with it; returns the message length or -1 */
+
+int
+sessionclient(int s); /* client: attach, wait until detached, return status */
+
+int
+sessionobserve(int s, const char *m); /* observer: ask for m, copy output
+                                         to stdout, return status */
+
+#endif
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Paste more than INPUT_BUFFER bytes into a program that doesn't read its
+# input for a while, and check that all of it gets through.
+MTM=${MTM:-./mtm}
+SIZE=${SIZE:-1048576}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+head -c "$SIZE" /dev/urandom | base64 | tr -d '\n' | head -c "$SIZE" >"$dir/in"
+cat >"$dir/reader" <<END
+#!/bin/sh
+stty raw -echo
+sleep 2
+head -c $SIZE >"$dir/out"
+touch "$dir/done"
+END
+chmod +x "$dir/reader"
+
+{
+    sleep 1
+    printf '\033[200~'
+    cat "$dir/in"
+    printf '\033[201~'
+    i=0
+    while [ ! -e "$dir/done" ] && [ $((i += 1)) -le 30 ]; do
+        sleep 1
+    done
+} | TERM=xterm timeout 40 script -qec "SHELL=$dir/reader $MTM" /dev/null \
+    >/dev/null 2>&1
+
+if cmp -s "$dir/in" "$dir/out"; then
+    echo "paste: ok"
+else
+    got=$(cat "$dir/out" 2>/dev/null | wc -c)
+    echo "paste: $got of $SIZE bytes got through"
+    exit 1
+fi
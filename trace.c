@@ -0,0 +1,67 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+typedef struct EVENT EVENT;
+struct EVENT{
+    int64_t ns; /* zero while the event is being written */
+    int32_t arg;
+    uint16_t kind, view;
+};
+
+static EVENT *events;
+static size_t size, head;
+
+bool
+starttrace(size_t n)
+{
+    events = calloc(n, sizeof(EVENT));
+    size = events? n : 0;
+    return events != NULL;
+}
+
+void
+traceevent(int kind, int view, long arg)
+{
+    struct timespec ts = {0};
+    if (!events)
+        return;
+
+    EVENT *e = events + (__atomic_fetch_add(&head, 1, __ATOMIC_RELAXED)
+                         & (size - 1));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    __atomic_store_n(&e->ns, 0, __ATOMIC_RELAXED);
+    e->arg = (int32_t)arg;
+    e->kind = (uint16_t)kind;
+    e->view = (uint16_t)view;
+    __atomic_store_n(&e->ns, ts.tv_sec * 1000000000LL + ts.tv_nsec,
+                     __ATOMIC_RELEASE);
+}
+
+void
+writetrace(FILE *f)
+{
+    /* Events being written as we go are skipped. One that is overwritten
+     * while we copy it can come out garbled, which is fine for a trace.
+     */
+    size_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    uint32_t hdr[2] = {TRACE_VERSION, sizeof(EVENT)};
+    uint64_t n = 0;
+
+    fwrite("MTMTRACE", 1, 8, f);
+    fwrite(hdr, sizeof(hdr), 1, f);
+    fwrite(&n, sizeof(n), 1, f);
+    for (size_t i = h > size? h - size : 0; i < h; i++){
+        EVENT *p = events + (i & (size - 1));
+        EVENT e = *p;
+        if (__atomic_load_n(&p->ns, __ATOMIC_ACQUIRE) == e.ns && e.ns){
+            fwrite(&e, sizeof(e), 1, f);
+            n++;
+        }
+    }
+    if (fseek(f, 16, SEEK_SET) == 0) /* now we know how many there were */
+        fwrite(&n, sizeof(n), 1, f);
+}
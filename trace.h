@@ -0,0 +1,37 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* The trace is a ring of timestamped events, oldest overwritten first.
+ * Any thread may add to it without taking a lock. Written out, it is a
+ * header followed by the events oldest first, all in host byte order:
+ *
+ *     header: char magic[8] = "MTMTRACE", uint32 version, uint32 event size,
+ *             uint64 number of events
+ *     event:  int64 CLOCK_MONOTONIC ns, int32 arg, uint16 kind, uint16 view
+ */
+#define TRACE_VERSION 1
+
+#define EV_WAKE    1 /* select returned; arg is the number of fds ready */
+#define EV_READ    2 /* read from a view's pty; arg is the byte count */
+#define EV_PARSE   3 /* started processing a view's output; arg is bytes */
+#define EV_PARSED  4 /* finished processing a view's output */
+#define EV_UPDATE  5 /* started updating the host terminal */
+#define EV_UPDATED 6 /* finished updating the host terminal; arg is the
+                            bytes sent, when mtm sends them itself */
+#define EV_KEY     7 /* key read; arg is the character, or -(key code) */
+#define EV_RESIZE  8 /* host terminal resized; arg is lines << 16 | cols */
+
+bool
+starttrace(size_t n); /* keep the last n events; n must be a power of two */
+
+void
+traceevent(int kind, int view, long arg); /* does nothing if tracing is off */
+
+void
+writetrace(FILE *f); /* write out the events recorded so far */
+
+#endif
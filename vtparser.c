@@ -51,7 +51,8 @@ static STATE ground, escape, escape_intermediate, csi_entry,
 static void
 reset(VTPARSER *v)
 {
-    v->inter = v->narg = v->nosc = 0;
+    v->inter = v->last = v->narg = v->nosc = 0;
+    v->subs = 0;
     memset(v->args, 0, sizeof(v->args));
     memset(v->oscbuf, 0, sizeof(v->oscbuf));
 }
@@ -66,6 +67,7 @@ static void
 collect(VTPARSER *v, wchar_t w)
 {
     v->inter = v->inter? v->inter : (int)w;
+    v->last = w >= 0x20 && w <= 0x2f? (int)w : v->last;
 }
 
 static void
@@ -80,25 +82,29 @@ param(VTPARSER *v, wchar_t w)
 {
     v->narg = v->narg? v->narg : 1;
 
-    if (w == L';')
-        v->args[v->narg++] = 0;
-    else if (v->narg < MAXPARAM && v->args[v->narg - 1] < 9999)
+    if (w == L';' || w == L':'){
+        if (v->narg < MAXPARAM){
+            v->subs |= (w == L':')? 1u << v->narg : 0;
+            v->args[v->narg++] = 0;
+        }
+    } else if (v->narg < MAXPARAM && v->args[v->narg - 1] < 9999)
         v->args[v->narg - 1] = v->args[v->narg - 1] * 10 + (w - 0x30);
 }
 
-#define DO(k, t, f, n, a)                               \
+#define DO(k, e, t, f, n, a)                            \
     static void                                         \
     do ## k (VTPARSER *v, wchar_t w)                    \
     {                                                   \
+        v->counts[VTPARSER_ ## e]++;                    \
         if (t)                                          \
             f (v, v->p, w, v->inter, n, a, v->oscbuf);  \
     }
 
-DO(control, w < MAXCALLBACK && v->cons[w], v->cons[w], 0, NULL)
-DO(escape,  w < MAXCALLBACK && v->escs[w], v->escs[w], v->inter > 0, &v->inter)
-DO(csi,     w < MAXCALLBACK && v->csis[w], v->csis[w], v->narg, v->args)
-DO(print,   v->print, v->print, 0, NULL)
-DO(osc,     v->osc, v->osc, v->nosc, NULL)
+DO(control, CONTROL, w < MAXCALLBACK && v->cons[w], v->cons[w], 0, NULL)
+DO(escape,  ESCAPE,  w < MAXCALLBACK && v->escs[w], v->escs[w], v->inter > 0, &v->inter)
+DO(csi,     CSI,     w < MAXCALLBACK && v->csis[w], v->csis[w], v->narg, v->args)
+DO(print,   PRINT,   v->print, v->print, 0, NULL)
+DO(osc,     OSC,     v->osc, v->osc, v->nosc, NULL)
 
 /**** PUBLIC FUNCTIONS */
 VTCALLBACK
@@ -157,6 +163,12 @@ vtwrite(VTPARSER *vp, const char *s, size_t n)
     }
 }
 
+int
+vtground(VTPARSER *vp)
+{
+    return (!vp->s || vp->s == &ground) && mbsinit(&vp->ms);
+}
+
 /**** STATE DEFINITIONS
  * This was built by consulting the excellent state chart created by
  * Paul Flo Williams: http://vt100.net/emu/dec_ansi_parser
@@ -209,9 +221,7 @@ MAKESTATE(escape_intermediate, NULL,
 
 MAKESTATE(csi_entry, reset,
     {0x20, 0x2f, collect, &csi_intermediate},
-    {0x3a, 0x3a, ignore,  &csi_ignore},
-    {0x30, 0x39, param,   &csi_param},
-    {0x3b, 0x3b, param,   &csi_param},
+    {0x30, 0x3b, param,   &csi_param},
     {0x3c, 0x3f, collect, &csi_param},
     {0x40, 0x7e, docsi,   &ground}
 );
@@ -222,9 +232,7 @@ MAKESTATE(csi_ignore, NULL,
 );
 
 MAKESTATE(csi_param, NULL,
-    {0x30, 0x39, param,   NULL},
-    {0x3b, 0x3b, param,   NULL},
-    {0x3a, 0x3a, ignore,  &csi_ignore},
+    {0x30, 0x3b, param,   NULL},
     {0x3c, 0x3f, ignore,  &csi_ignore},
     {0x20, 0x2f, collect, &csi_intermediate},
     {0x40, 0x7e, docsi,   &ground}
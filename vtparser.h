@@ -53,23 +53,26 @@ typedef struct STATE STATE;
 typedef void (*VTCALLBACK)(VTPARSER *v, void *p, wchar_t w, wchar_t iw,
                            int argc, int *argv, const wchar_t *osc);
 
+typedef enum{
+    VTPARSER_CONTROL,
+    VTPARSER_ESCAPE,
+    VTPARSER_CSI,
+    VTPARSER_OSC,
+    VTPARSER_PRINT
+} VtEvent;
+
 struct VTPARSER{
     STATE *s;
     int narg, nosc, args[MAXPARAM], inter, oscbuf[MAXOSC + 1];
+    int last; /* the last intermediate (0x20-0x2f) collected, if any */
+    unsigned subs; /* bit n is set if args[n] followed a colon */
+    unsigned long long counts[VTPARSER_PRINT + 1]; /* events seen, by type */
     mbstate_t ms;
     void *p;
     VTCALLBACK print, osc, cons[MAXCALLBACK], escs[MAXCALLBACK],
                csis[MAXCALLBACK];
 };
 
-typedef enum{
-    VTPARSER_CONTROL,
-    VTPARSER_ESCAPE,
-    VTPARSER_CSI,
-    VTPARSER_OSC,
-    VTPARSER_PRINT
-} VtEvent;
-
 /**** FUNCTIONS */
 VTCALLBACK
 vtonevent(VTPARSER *vp, VtEvent t, wchar_t w, VTCALLBACK cb);
@@ -77,4 +80,7 @@ vtonevent(VTPARSER *vp, VtEvent t, wchar_t w, VTCALLBACK cb);
 void
 vtwrite(VTPARSER *vp, const char *s, size_t n);
 
+int
+vtground(VTPARSER *vp); /* nonzero if not partway through a sequence */
+
 #endif
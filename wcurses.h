@@ -0,0 +1,14 @@
+#ifndef WCURSES_H
+#define WCURSES_H
+
+/* The path for the wide-character curses library. */
+#ifndef NCURSESW_INCLUDE_H
+    #if defined(__APPLE__) || !defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+        #define NCURSESW_INCLUDE_H <curses.h>
+    #else
+        #define NCURSESW_INCLUDE_H <ncursesw/curses.h>
+    #endif
+#endif
+#include NCURSESW_INCLUDE_H
+
+#endif
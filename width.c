@@ -0,0 +1,42 @@
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "width.h"
+
+#define PAGE    256 /* characters to a page */
+#define MAXCHAR 0x110000
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+
+static signed char *pages[MAXCHAR / PAGE];
+
+static signed char *
+fillpage(size_t i) /* Work out the widths in page i and publish them. */
+{
+    signed char *p = malloc(PAGE), *o = NULL;
+    if (!p)
+        return NULL;
+    for (size_t j = 0; j < PAGE; j++)
+        p[j] = (signed char)wcwidth((wchar_t)(i * PAGE + j));
+
+    /* Another thread may have got here first, in which case we use its. */
+    if (!__atomic_compare_exchange_n(pages + i, &o, p, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        free(p);
+        return o;
+    }
+    return p;
+}
+
+int
+charwidth(wchar_t c)
+{
+    if (c >= 0x20 && c < 0x7f)
+        return 1;
+    if (c < 0 || (unsigned long)c >= MAXCHAR)
+        return wcwidth(c);
+
+    signed char *p = LOAD(pages[c / PAGE]);
+    if (!p && !(p = fillpage((size_t)c / PAGE)))
+        return wcwidth(c);
+    return p[c % PAGE];
+}
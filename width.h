@@ -0,0 +1,14 @@
+#ifndef WIDTH_H
+#define WIDTH_H
+
+#include <wchar.h>
+
+/* Character widths are looked up in a table, filled in from wcwidth(3) a
+ * page at a time the first time a character in that page is seen, so that
+ * they always agree with curses and the host terminal. The locale must be
+ * set before the first lookup. Any thread may look widths up.
+ */
+int
+charwidth(wchar_t c); /* like wcwidth(3) */
+
+#endif